@@ -1,1506 +1,1037 @@
-#include <string>
-#include <map>
-#include <vector>
-#include <iostream>
-#include <fstream>
-#include <algorithm>
-#include <cassert>
-#include <chrono>
-#include <array>
-
-static const uint8_t kEndTrackMarker = 0x0f;
-static const int kMaxDelay = 256;
-static const int kMaxRefOffset = 16384;
-static const int kPsg2iSize = 32;
-
-static const int kMaxTimeForL4 = 930;
-
-enum Flags
-{
-    none = 0,
-    
-    cleanRegs  = 2,
-    cleanToneA = 4,
-    cleanToneB = 8,
-    cleanToneC = 16,
-    cleanEnvelope = 32,
-    cleanEnvForm = 64,
-    cleanNoise = 128,
-    
-    dumpPsg = 256,
-    dumpTimings = 512,
-    addScf = 1024
-};
+#include "psg_packer.h"
+#include "psg_unpacker.h"
+#include "z80_player.h"
 
-enum class TimingState
-{
-    single,
-    longFirst,
-    first,
-    mid,
-    last
-};
+#include <atomic>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
 
-enum CompressionLevel
-{
-    l0,   //< Maximum speed. Max frame time=802t.
-    l1,   //< Same max frame time, avarage frame size worse a little bit, better compression.
-    l2,   //< Max frame time about 828t, better compression.
-    l3,   //< Max frame time above 900t, better compression.
-    l4,   //< Allow recursive refs. It requires slow_psg_player.asm
-};
-
-static const int kDefaultFlags = cleanNoise - 1;
-
-using RegMap = std::map<int, int>;
-using RegVector = std::array<int, 14>;
-
-auto splitRegs(const RegMap& regs)
-{
-    int firstRegs = 0;
-    int secondRegs = 0;
-    for (const auto& reg : regs)
-    {
-        if (reg.first < 6)
-            ++firstRegs;
-        else
-            ++secondRegs;
-    }
-    return std::tuple<int, int>(firstRegs, secondRegs);
-}
+#ifndef PSG_PACK_PLAYER_DIR
+#define PSG_PACK_PLAYER_DIR "include"
+#endif
 
-uint8_t reverseBits(uint8_t value)
+bool hasShortOpt(const std::string& s, char option)
 {
-    uint8_t b = value;
-    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-    return b;
+    if (s.size() >= 2 && s[0] == '-' && s[1] == '-')
+        return false;
+    if (s.empty() || s[0] != '-')
+        return false;
+    return s.find(option) != std::string::npos;
 }
 
-uint8_t makeRegMask(const RegMap& regs, int from, int to)
+CutRange parseRange(const std::string& value)
 {
-    uint8_t result = 0;
-    uint8_t bit = 0x80;
-    for (int i = from; i < to; ++i)
+    CutRange result;
+    int pos = value.find(',');
+    if (pos == -1)
     {
-        const auto reg = regs.find(i);
-        if (reg == regs.end())
-        {
-            result += bit;
-        }
-        bit >>= 1;
+        result.to = std::stoi(value);
+    }
+    else
+    {
+        auto s1 = value.substr(0, pos);
+        auto s2 = value.substr(pos+1);
+        result.from = std::stoi(s1);
+        result.to = std::stoi(s2);
     }
     return result;
 }
 
-uint16_t longRegMask(const RegMap& regs)
-{
-    uint8_t mask1 = makeRegMask(regs, 0, 6);
-    uint8_t mask2 = makeRegMask(regs, 6, 14);
-
-    mask1 = reverseBits(mask1) << 2;
-    mask2 = reverseBits(mask2);
-
-    return mask1 + mask2 * 256;
-}
-
-struct Stats
-{
-    int outPsgFrames = 0;
-    int inPsgFrames = 0;
-
-    int emptyCnt = 0;
-    int emptyFrames = 0;
-
-    int singleRepeat = 0;
-    int allRepeat = 0;
-    int allRepeatFrames = 0;
-
-    int ownCnt = 0;
-    int ownBytes = 0;
-
-    std::map<int, int> frameRegs;
-    std::map<int, int> regsChange;
-
-    std::map<int, int> firstHalfRegs;
-    std::map<int, int> secondHalfRegs;
-
-    int unusedToneA = 0;
-    int unusedToneB = 0;
-    int unusedToneC = 0;
-    int unusedEnvelope = 0;
-    int unusedEnvForm = 0;
-    int unusedNoise = 0;
-    bool addScf = false;
-
-    std::map<int, int> maskToUsage;
-    std::multimap<int, int> usageToMask;
-    std::map<int, int> maskIndex;
-    CompressionLevel level = CompressionLevel::l1;
-};
-
-bool isPsg2(const RegMap& regs, uint16_t symbol, const Stats& stats)
-{
-    return regs.size() > 1;
-}
-
-struct RefInfo
+/**
+ * Command line options of the front end. They are not passed to the packer.
+ */
+struct CliOptions
 {
-    int refTo = -1;
-    int reducedLen = 0;
-    int refLen = 0;
-    int level = 0;
-    int offsetInRef = 0;
+    bool batch = false;          //< --batch
+    bool autoMode = false;       //< --auto
+    std::string cacheDir;
+    bool profile = false;        //< --profile
+    std::string profileFileName; //< --profile-json
+    bool verify = false;         //< --verify
+    bool measure = false;        //< --measure
+    std::string playerDir = PSG_PACK_PLAYER_DIR;
 };
 
-class TimingsHelper
+int parseArgs(int argc, char** argv, PgsPacker* packer, CliOptions& cli)
 {
-private:
-    const Stats& m_stats;
-    const std::vector<RefInfo>& m_refInfo;
-public:
-    TimingsHelper(const Stats& stats, const std::vector<RefInfo>& refInfo):
-        m_stats(stats),
-        m_refInfo(refInfo)
-    {
-    }
-
-    int trbRepTimings(int trdRep)
-    {
-        if (m_stats.level < 4)
-        {
-            if (trdRep == 0)
-                return 7 + 4 + 11;
-            int result = 7 + 4 + 5;
-            if (trdRep > 1)
-            {
-                result += 13 + 11;
-                return result;
-            }
-
-            result += 13 + 5 + 42;
-            return result;
-        }
-        else
-        {
-            if (trdRep != 1)
-                return 4 + 11 + 11;
-            return 20+34;
-        }
-    }
-
-    int frameTimings(const RegMap& regs, int trbRep, uint16_t symbol)
-    {
-        int result = 0;
-        if (m_stats.level < 4)
-            result += 28 + 17;  //< before pl_frame
-        else
-            result += 34+5 +17;  //< before pl_frame
-        result += pl0xTimings(regs, symbol);
-        if (m_stats.level < 4)
-            result += 16;
-        else
-            result += 59;
-
-        return result + trbRepTimings(trbRep);
-    }
-
-    int pause_cont()
-    {
-        if (m_stats.level < 4)
-            return 13 + 16 + 4 + 13 + 10 + 16 + 10 + 10;
-        return 114;
-    }
-
-    int after_play_frame(int trbRep)
-    {
-        int result = 0;
-        if (m_stats.level < 4)
-            result += 16;
-        else
-            result += 59;
-        return result + trbRepTimings(trbRep);
-    }
-
-    int delayTimings(TimingState state, int trbRep)
-    {
-        int pl_pause = m_stats.level < 4 ? 98 : 109;
-        int result = 0;
-        switch (state)
-        {
-            case TimingState::single:
-                result = pl_pause + 12 + 7 + 6 + 12 + 10 + 10;
-                result += after_play_frame(trbRep);
-                break;
-            case TimingState::longFirst:
-                result = pl_pause + 7 + 12 + 6 + 7 + 6 + 12 + pause_cont();
-                break;
-            case TimingState::first:
-                result = pl_pause + 12 + 7 + 6 + 7 + pause_cont();
-                break;
-            case TimingState::mid:
-                result = 12 + 10 + 11 + 11;
-                break;
-            case TimingState::last:
-                result = 12 + 26 + 38;
-                if (m_stats.level >= 4)
-                    result += 16;
-                result += trbRepTimings(trbRep);
-                break;
-        }
-        return result;
-    }
-
-    static int play_all_6_13(const RegMap& regs)
-    {
-        int result = 341;
-        if (regs.count(13) == 0)
-            result -= 35;
-        return result;
-    }
-
-    int play_by_mask_13_6(const RegMap& regs)
-    {
-        int result = 53;
-        if (regs.count(13) == 0)
-            result -= 34;
-        for (int i = 12; i > 6; --i)
-        {
-            result += 54;
-            if (regs.count(i) == 0)
-                result -= 34;
-        }
-
-        if (regs.count(6) == 0)
-        {
-            result += 4 + 11;
-            if (m_stats.addScf)
-                result -= 4; //< Early 'ret c' here. There is no 'scf' overhead.
-        }
-        else
-        {
-            result += 55;
-        }
-
-        return result;
-    }
-
-    int reg_left_6(const RegMap& regs)
-    {
-        int result = 0;
-
-        if (regs.count(5))
-            result += 4 + 7 + 12 + 4 + 16 + 7;
-        else
-            result += 4+12;
-
-        for (int i = 4; i > 0; --i)
-        {
-            if (regs.count(i))
-                result += 54;
-            else
-                result += 20;
-        }
-
-        if (regs.count(0) == 0)
-        {
-            result += 4 + 11;
-        }
-        else
-        {
-            if (m_stats.addScf)
-                result += 4; //< Extra 'scf' here.
-            result += 55;
-        }
-
-        return result;
-    }
-
-    int play_all_0_5_end(const RegMap& regs)
-    {
-        const auto [firstRegs, secondRegs] = splitRegs(regs);
-        int secondRegsExcept13 = secondRegs;
-        if (regs.count(13) == 1)
-            --secondRegsExcept13;
-
-        int result = 24;
-
-        if (secondRegsExcept13 == 7)
-            result += play_all_6_13(regs);
-        else
-            result += 5 + play_by_mask_13_6(regs);
-
-        return result;
-    }
-
-    int pl00TimeForFrame(const RegMap& regs, uint16_t symbol)
-    {
-        if (regs.size() == 1)
-            return 4 + 12 + 4 + 7 + 7 + 7+7+7+4+6+45;
-
-        return 29+53+17 + reg_left_6(regs) + 36 + play_by_mask_13_6(regs);
-    }
-
-    int pl0xTimings(const RegMap& regs, uint16_t symbol)
+    for (int i = 1; i < argc - 2; ++i)
     {
-        const auto [firstRegs, secondRegs] = splitRegs(regs);
-        int secondRegsExcept13 = secondRegs;
-        if (regs.count(13) == 1)
-            --secondRegsExcept13;
-
-        uint16_t longMask = longRegMask(regs);
-        bool psg2 = isPsg2(regs, symbol, m_stats);
-        if (!psg2 || m_stats.maskIndex.count(longMask))
-            return 21 + 5 + pl00TimeForFrame(regs, symbol);
-
-        // PSG2 timings
-        int result = 44; //< Till jump to play_all_0_5
-
-        if (firstRegs < 6)
+        const std::string s = argv[i];
+        if (hasShortOpt(s, 'l') || s == "--level")
         {
-            // play_by_mask_0_5
-            for (int i = 0; i < 5; ++i)
-            {
-                if (regs.count(i) == 0)
-                    result += 20; //< There is no reg i.
-                else
-                    result += 54;
-            }
-
-            if (regs.count(5) == 0)
+            if (i == argc - 1)
             {
-                result += 4 + 12; // 'play_all_0_5_end' reached
-                result += play_all_0_5_end(regs);
+                std::cerr << "It need to define compression leven in range [0..4] after the argument '--level'" << std::endl;
+                return -1;
             }
-            else
+            int value = atoi(argv[i + 1]);
+            if (value < 0 || value > 5)
             {
-                result += 43 + 24;
-                if (secondRegsExcept13 == 7)
-                    result += 5 + play_all_6_13(regs);
-                else
-                    result += 7 + 10 + play_by_mask_13_6(regs);
+                std::cerr << "Invalid compression level " << value << ". Expected value in range [0..5]" << std::endl;
+                return -1;
             }
+            packer->stats.level = (CompressionLevel)value;
         }
-        else
-        {
-            result += 5;
-            result += 240;
-            result += play_all_0_5_end(regs);
-        }
-
-        return result;
-    }
-
-    int shortRefTimings(const RegMap& regs, uint16_t symbol, int trbRep)
-    {
-        int result = m_stats.level >= 4 ? 185 : 115;
-        result += TimingsHelper::pl0xTimings(regs, symbol);
-        if (m_stats.level >= 4)
-            result += trbRepTimings(trbRep);
-        return result;
-    }
-
-    int longRefInitTiming(int pos, const RegMap& regs, uint16_t symbol, int symbolsLeftAtLevel)
-    {
-        int result = m_stats.level >= 4 ? 269 : 170;
-
-        if (m_stats.level >= 4 && symbolsLeftAtLevel == 1)
-        {
-            // same level ref
-            result -= 26 - 5;
-        }
-
-        result += TimingsHelper::pl0xTimings(regs, symbol);
-        return result;
-    }
-};
-
-struct CutRange
-{
-    int from = -1;
-    int to = -1;
-
-    bool isEmpty() const { return from == -1 && to == -1; }
-};
-
-class PgsPacker
-{
-public:
-
-    PgsPacker() : th(stats, refInfo) {}
-
-    struct FrameInfo
-    {
-        uint16_t symbol = 0;
-        RegVector fullState;
-        RegMap delta;
-    };
-
-    std::map<RegMap, uint16_t> regsToSymbol;
-    std::map<uint16_t, RegMap> symbolToRegs;
-    std::vector<FrameInfo> ayFrames;
-
-    RegMap changedRegs;
-
-    RegVector lastOrigRegs;
-    RegVector lastCleanedRegs;
-    RegVector prevCleanedRegs;
-    RegVector prevTonePeriod;
-    RegVector prevEnvelopePeriod;
-    RegVector prevEnvelopeForm;
-    RegVector prevNoisePeriod;
-    std::map<int, int> symbolsToInflate;
-
-    Stats stats;
-    TimingsHelper th;
-
-    std::vector<uint8_t> srcPsgData;
-    std::vector<uint8_t> updatedPsgData;
-    std::vector<uint8_t> compressedData;
-    std::vector<RefInfo> refInfo;
-    std::vector<int> frameOffsets;
-    int flags = kDefaultFlags;
-    bool firstFrame = false;
-    std::vector<int> timingsData;
-
-    std::vector<CutRange> cutRanges;
-private:
-
-    uint16_t toSymbol(const RegMap& regs)
-    {
-        auto itr = regsToSymbol.find(regs);
-        if (itr != regsToSymbol.end())
-            return itr->second;
-
-        uint16_t value = regsToSymbol.size();
-        regsToSymbol.emplace(regs, value);
-        symbolToRegs.emplace(value, regs);
-        return value;
-    }
-
-    // This code ported from PHP to cpp from tmk&bfox ayPacker.
-    void doCleanRegs()
-    {
-        // Normalize regs values (only usage bits).
-
-        lastCleanedRegs = lastOrigRegs;
-
-        lastCleanedRegs[1] &= 15;
-        lastCleanedRegs[3] &= 15;
-        lastCleanedRegs[5] &= 15;
-        lastCleanedRegs[6] &= 31;
-        lastCleanedRegs[7] &= 63;
-        lastCleanedRegs[8] &= 31;
-        lastCleanedRegs[9] &= 31;
-        lastCleanedRegs[10] &= 31;
-        lastCleanedRegs[13] &= 15;
-
-        lastCleanedRegs[7] &= 63;
-
-        // clean volume (do AND_16 if envelope mode)
-
-        for (int i : {8, 9, 10})
-        {
-            if (lastCleanedRegs[i] & 16)
-                lastCleanedRegs[i] = 16;
-        }
-
-        // Clean tone period.
-
-        /* toneA */
-        if (flags & cleanToneA)
+        if (s == "--cut")
         {
-            if (lastOrigRegs[8] == 0 || (lastOrigRegs[7] & 1) != 0)
-            {
-                lastCleanedRegs[0] = prevTonePeriod[0];
-                lastCleanedRegs[1] = prevTonePeriod[1];
-                stats.unusedToneA++;
-            }
-            else
+            if (i == argc - 1)
             {
-                prevTonePeriod[0] = lastOrigRegs[0];
-                prevTonePeriod[1] = lastOrigRegs[1];
+                std::cerr << "It need to define cut value in frames after the argument '--cut'. Example: 0,1000." << std::endl;
+                return -1;
             }
+            auto range = parseRange(argv[i + 1]);
+            packer->cutRanges.push_back(range);
         }
-        /* toneB */
-        if (flags & cleanToneB)
+        if (s == "--threads")
         {
-            if (lastOrigRegs[9] == 0 || (lastOrigRegs[7] & 2) != 0)
+            if (i == argc - 1)
             {
-                lastCleanedRegs[2] = prevTonePeriod[2];
-                lastCleanedRegs[3] = prevTonePeriod[3];
-                stats.unusedToneB++;
+                std::cerr << "It need to define threads count after the argument '--threads'" << std::endl;
+                return -1;
             }
-            else
+            int value = atoi(argv[i + 1]);
+            if (value < 1)
             {
-                prevTonePeriod[2] = lastOrigRegs[2];
-                prevTonePeriod[3] = lastOrigRegs[3];
+                std::cerr << "Invalid threads count " << value << ". Expected value >= 1" << std::endl;
+                return -1;
             }
+            packer->threads = value;
         }
-        /* toneC */
-        if (flags & cleanToneC)
+        if (s == "--max-t")
         {
-            if (lastOrigRegs[10] == 0 || (lastOrigRegs[7] & 4) != 0)
+            if (i == argc - 1)
             {
-                lastCleanedRegs[4] = prevTonePeriod[4];
-                lastCleanedRegs[5] = prevTonePeriod[5];
-                stats.unusedToneC++;
+                std::cerr << "It need to define max frame time in t-states after the argument '--max-t'" << std::endl;
+                return -1;
             }
-            else
+            int value = atoi(argv[i + 1]);
+            if (value < 1)
             {
-                prevTonePeriod[4] = lastOrigRegs[4];
-                prevTonePeriod[5] = lastOrigRegs[5];
+                std::cerr << "Invalid max frame time " << value << ". Expected value > 0" << std::endl;
+                return -1;
             }
+            packer->timeLimit = value;
         }
-
-        // Clean envelope period.
-
-        if (flags & cleanEnvelope)
+        if (s == "--lazy")
         {
-            if ((lastOrigRegs[8] & 16) == 0 && (lastOrigRegs[9] & 16) == 0 && (lastOrigRegs[10] & 16) == 0)
+            if (i == argc - 1)
             {
-                lastCleanedRegs[11] = prevEnvelopePeriod[11];
-                lastCleanedRegs[12] = prevEnvelopePeriod[12];
-                stats.unusedEnvelope++;
+                std::cerr << "It need to define lookahead frames after the argument '--lazy'" << std::endl;
+                return -1;
             }
-            else
+            int value = atoi(argv[i + 1]);
+            if (value < 0 || value > kMaxLazySteps)
             {
-                prevEnvelopePeriod[11] = lastOrigRegs[11];
-                prevEnvelopePeriod[12] = lastOrigRegs[12];
+                std::cerr << "Invalid lookahead " << value << ". Expected value in range [0.." << kMaxLazySteps << "]" << std::endl;
+                return -1;
             }
+            packer->lazySteps = value;
         }
-
-        /* clean envelope form */
-
-        if (flags & cleanEnvForm)
+        if (s == "--cache-dir")
         {
-            if ((lastOrigRegs[8] & 16) == 0 && (lastOrigRegs[9] & 16) == 0 && (lastOrigRegs[10] & 16) == 0)
+            if (i == argc - 1 || i + 1 >= argc - 2)
             {
-                lastCleanedRegs[13] = prevEnvelopeForm[13];
-                stats.unusedEnvForm++;
-            }
-            else
-            {
-                prevEnvelopeForm[13] = lastOrigRegs[13];
+                std::cerr << "It need to define cache directory after the argument '--cache-dir'" << std::endl;
+                return -1;
             }
+            cli.cacheDir = argv[i + 1];
         }
-
-        /* clean noise period */
-
-        if (flags & cleanNoise)
+        if (s == "--profile")
         {
-            if ((lastOrigRegs[7] & 8) != 0 && (lastOrigRegs[7] & 16) != 0 && (lastOrigRegs[7] & 32) != 0)
-            {
-                lastCleanedRegs[6] = prevNoisePeriod[6];
-                stats.unusedNoise++;
-            }
-            else
-            {
-                prevNoisePeriod[6] = lastCleanedRegs[6];
-            }
+            cli.profile = true;
         }
-    }
-
-    void extendToFullChangeIfNeed(int firstThreshold, int secondThreshold)
-    {
-        decltype(changedRegs) firstReg, secondReg;
-        for (const auto& reg : changedRegs)
+        if (s == "--profile-json")
         {
-            if (reg.first < 6)
-                firstReg.insert(reg);
-            else if (reg.first != 13)
-                secondReg.insert(reg);
+            if (i == argc - 1 || i + 1 >= argc - 2)
+            {
+                std::cerr << "It need to define JSON file name after the argument '--profile-json'" << std::endl;
+                return -1;
+            }
+            cli.profileFileName = argv[i + 1];
         }
-
-        if (firstReg.size() >= firstThreshold)
+        if (s == "--verify")
         {
-            // Regs are about to full. Extend them to full regs.
-            for (int i = 0; i < 6; ++i)
-                changedRegs[i] = lastCleanedRegs[i];
+            cli.verify = true;
         }
-
-        if (secondReg.size() >= secondThreshold)
+        if (s == "--measure")
         {
-            // Regs are about to full. Extend them to full regs (exclude reg13)
-            for (int i = 6; i < 13; ++i)
-                changedRegs[i] = lastCleanedRegs[i];
+            cli.measure = true;
         }
-    }
-
-    bool writeRegs()
-    {
-        if (changedRegs.empty())
-            return false;
-
-        if (prevTonePeriod.empty())
+        if (s == "--player-dir")
         {
-            for (int i = 0; i < 13; ++i)
+            if (i == argc - 1 || i + 1 >= argc - 2)
             {
-                changedRegs.emplace(i, 0);
-                lastOrigRegs[i] = 0;
+                std::cerr << "It need to define players directory after the argument '--player-dir'" << std::endl;
+                return -1;
             }
-
-            // Initial value
-            prevTonePeriod = lastOrigRegs;
-            prevEnvelopePeriod = lastOrigRegs;
-            prevEnvelopeForm = lastOrigRegs;
-            prevNoisePeriod = lastOrigRegs;
+            cli.playerDir = argv[i + 1];
         }
-
-        int unusedEnvForm = stats.unusedEnvForm;
-        lastCleanedRegs = lastOrigRegs;
-        if (flags & cleanRegs)
-            doCleanRegs();
-
-
-        RegMap delta;
-        for (int i = 0; i < 14; ++i)
-        {
-            if (firstFrame || lastCleanedRegs[i] != prevCleanedRegs[i])
-                delta[i] = lastCleanedRegs[i];
-        }
-        firstFrame = false;
-        prevCleanedRegs = lastCleanedRegs;
-
-        if (changedRegs.count(13) && !(flags & cleanRegs))
-            delta[13] = changedRegs[13]; //< Can be retrig.
-
-        changedRegs = delta;
-        if (changedRegs.empty())
-            return false;
-
-        if (flags & dumpPsg)
+        if (s == "--optimal")
         {
-            if (updatedPsgData.empty())
-                updatedPsgData.insert(updatedPsgData.end(), srcPsgData.begin(), srcPsgData.begin() + 16);
-
-            updatedPsgData.push_back(0xff);
-            for (const auto& reg : changedRegs)
-            {
-                updatedPsgData.push_back(reg.first);
-                updatedPsgData.push_back(reg.second);
-            }
+            packer->flags |= optimalParse;
         }
-
-        if (stats.level < l3 || symbolsToInflate.count(toSymbol(changedRegs)))
-            extendToFullChangeIfNeed(5, 5);
-        //else if (stats.level == l4)
-        //    extendToFullChangeIfNeed(5, 6);
-
-        uint16_t symbol = toSymbol(changedRegs);
-        ayFrames.push_back({ symbol, lastCleanedRegs, changedRegs }); //< Flush previous frame.
-
-        if (changedRegs.size() > 1 && changedRegs.size() <= 6)
+        if (s == "--repack-mask-index")
         {
-            uint16_t mask = longRegMask(changedRegs);
-            ++stats.maskToUsage[mask];
+            packer->flags |= repackMaskIndex;
         }
-
-        ++stats.outPsgFrames;
-
-        changedRegs.clear();
-        return true;
-    }
-
-    void writeDelay(int delay)
-    {
-        if (flags & dumpPsg)
+        if (s == "--batch")
         {
-            for (int i = 0; i < delay; ++i)
-                updatedPsgData.push_back(0xff);
+            cli.batch = true;
         }
-
-        if (delay < 1)
-            return;
-
-        ++stats.outPsgFrames;
-
-        if (!ayFrames.empty() && ayFrames.rbegin()->symbol <= kMaxDelay)
+        if (s == "--auto")
         {
-            // Cleanup regs could wipe out regs chaning at all. That way it could be possible two delay records in a row. Merge them.
-            delay += lastDelayValue;
-            for (int i = 0; i < lastDelayBytes; ++i)
-                ayFrames.pop_back();
+            cli.autoMode = true;
         }
-
-        int prevSize = ayFrames.size();
-        lastDelayValue = delay;
-        while (delay > 0)
+        if (hasShortOpt(s, 'c') || s == "--clean")
         {
-            uint16_t d = std::min(kMaxDelay, delay);
-            ayFrames.push_back({ d }); //< Special code for delay
-            delay -= d;
+            packer->flags |= cleanRegs;
         }
-        lastDelayBytes = ayFrames.size() - prevSize;
-
-    }
-
-    void serializeDelayTimings(int count, int trbRep)
-    {
-        if (count == 1)
+        if (hasShortOpt(s, 'k') || s == "--keep")
         {
-            timingsData.push_back(th.delayTimings(TimingState::single, trbRep));
+            packer->flags &= ~cleanRegs;
         }
-        else
+        if (hasShortOpt(s, 'd') || s == "--dump")
         {
-            auto state = count > 16 ? TimingState::longFirst : TimingState::first;
-            timingsData.push_back(th.delayTimings(state, trbRep));
-            for (int i = 1; i < count - 1; ++i)
-                timingsData.push_back(th.delayTimings(TimingState::mid, trbRep));
-            timingsData.push_back(th.delayTimings(TimingState::last, trbRep));
+            packer->flags |= dumpPsg;
         }
-    }
-
-    void serializeDelay(int count)
-    {
-        if (count > 0)
-            serializeDelayTimings(count, 0);
-
-        while (count > 0)
+        if (hasShortOpt(s, 'i') || s == "--info")
         {
-            int value = std::min(kMaxDelay, count);
-            if (value > 16)
-            {
-                compressedData.push_back(0);
-                compressedData.push_back((uint8_t)value - 1);
-            }
-            else
-            {
-                uint8_t header = 0x10;
-                compressedData.push_back(header + value - 1);
-            }
-            count -= value;
+            packer->flags |= dumpTimings;
         }
-    };
-
-    void serializeRef(uint16_t pos, int len, uint8_t reducedLen)
-    {
-        int refTiming = serializeRefTimings(pos, len, reducedLen, 0);
-        if (stats.level == CompressionLevel::l4)
+        if (s == "--scf")
         {
-            const auto symbol = ayFrames[pos].symbol;
-            if (refTiming > kMaxTimeForL4)
-                ++symbolsToInflate[symbol];
+            // Undocumented option. Ensure 'c' flag is always on after the player. This option affects timings calculating only. It reffers to the internal player version from zx_scrool
+            packer->flags |= addScf;
+            packer->stats.addScf = true;
         }
-
-        int offset = frameOffsets[pos];
-        int recordSize = len == 1 ? 2 : 3;
-        int16_t delta = offset - compressedData.size() - recordSize;
-        if (len > 1 && stats.level < CompressionLevel::l4)
-            ++delta;
-        assert(delta < 0);
-
-        uint8_t* ptr = (uint8_t*)&delta;
-
-        if (len == 1)
-            ptr[1] &= ~0x40; // reset 6-th bit
-
-        // Serialize in network byte order
-        compressedData.push_back(ptr[1]);
-        compressedData.push_back(ptr[0]);
-
-        if (len > 1)
-            compressedData.push_back(reducedLen);
-    };
-
-    int shortRefTiming(int pos, int trbRep)
-    {
-        auto symbol = ayFrames[pos].symbol;
-        auto regs = symbolToRegs[symbol];
-
-        return th.shortRefTimings(regs, symbol, trbRep);
     }
-
-    int longRefInitTiming(int pos, int symbolsLeftAtLevel)
+    if (cli.measure && (packer->flags & addScf))
     {
-        auto symbol = ayFrames[pos].symbol;
-        auto regs = symbolToRegs[symbol];
-        return th.longRefInitTiming(pos, regs, symbol, symbolsLeftAtLevel);
-    }
-
-    bool isNestedShortRef(int pos)
-    {
-        bool result = refInfo[pos].refLen == 1;
-        return result;
-    }
-
-    bool isNestedLongRefStart(int pos)
-    {
-        bool result = refInfo[pos].refLen > 1 && refInfo[pos].refTo >= 0;
-        return result;
+        std::cerr << "The option '--measure' runs the players from '" << cli.playerDir << "'. They have no 'scf', use it without '--scf'" << std::endl;
+        return -1;
     }
-
-    int serializeRefTimings(int pos, int len, int reducedLen, int prevReducedLen)
+    for (int level : { l0, l4 })
     {
-        if (len == 1)
+        const auto fileName = Z80Player::playerFileName(cli.playerDir, level);
+        if (cli.measure && !std::ifstream(fileName).is_open())
         {
-            timingsData.push_back(shortRefTiming(pos, reducedLen)); // First frame
-            return *timingsData.rbegin();
-        }
-
-        const int endPos = pos + len;
-
-        int result = longRefInitTiming(pos, prevReducedLen);
-        timingsData.push_back(result); // First frame
-        ++pos;
-        for (; pos < endPos; ++pos)
-        {
-            auto symbol = ayFrames[pos].symbol;
-            if (symbol <= kMaxDelay)
-            {
-                serializeDelayTimings(symbol, reducedLen);
-            }
-            else if (isNestedShortRef(pos))
-            {
-                timingsData.push_back(shortRefTiming(refInfo[pos].refTo, reducedLen));
-                if (stats.level < CompressionLevel::l4)
-                    continue; //< skip decrement reducedLen
-            }
-            else if (isNestedLongRefStart(pos))
-            {
-                serializeRefTimings(refInfo[pos].refTo, refInfo[pos].refLen, refInfo[pos].reducedLen, reducedLen);
-                pos += refInfo[pos].refLen - 1;
-            }
-            else
-            {
-                auto regs = symbolToRegs[symbol];
-                int result = th.frameTimings(regs, reducedLen, symbol);
-                timingsData.push_back(result);
-            }
-            --reducedLen;
+            std::cerr << "Can't open player source " << fileName << ". Set the players directory with '--player-dir'" << std::endl;
+            return -1;
         }
-        assert(reducedLen == 0);
-        assert(pos == endPos);
-        return result;
     }
+    return 0;
+}
 
+int packParsed(PgsPacker& packer)
+{
+    int result = packer.packPsg();
 
-    void serializeFrame(uint16_t pos)
-    {
-        int prevSize = compressedData.size();
-
-        uint16_t symbol = ayFrames[pos].symbol;
-        auto regs = symbolToRegs[symbol];
-
-        timingsData.push_back(th.frameTimings(regs, 0, symbol));
+    // Timings are fail. Extend slow symbols and pack again.
+    while (result == 0 && packer.inflateSymbols())
+        result = packer.packPsg();
+    if (result == 0)
+        packer.optimizeMaskIndex();
+    return result;
+}
 
-        uint8_t header1 = 0;
+int writeOutputFiles(PgsPacker& packer, const std::string& outputFileName)
+{
+    int result = packer.writePackedFile(outputFileName);
+    if (result != 0)
+        return result;
 
-        uint16_t longMask = longRegMask(regs);
-        bool usePsg2 = isPsg2(regs, symbol, stats);
+    if (packer.flags & dumpPsg)
+        packer.writeRawPsg(outputFileName + ".psg");
+    if (packer.flags & dumpTimings)
+        packer.writeTimingsFile(outputFileName + ".csv");
+    return 0;
+}
 
+/**
+ * Whole input file in memory. Regular files are mapped, stdin and pipes are read.
+ */
+struct InputData
+{
+    MappedFile mappedFile;
+    std::vector<uint8_t> buffer;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
 
-        auto itr = stats.maskIndex.find(longMask);
-        if (usePsg2)
+    bool open(const std::string& fileName)
+    {
+        if (fileName != "-" && mappedFile.open(fileName))
         {
-            if (itr != stats.maskIndex.end())
-            {
-                header1 = 0x20 + itr->second;
-            }
-            else
-            {
-                auto mask = (makeRegMask(regs, 0, 6) >> 2);
-                header1 = 0x40 + mask;
-            }
-            compressedData.push_back(header1);
-
-            int firstsHalfRegs = 0; //< Statistics
-            if (itr != stats.maskIndex.end())
-            {
-                for (auto itr = regs.rbegin(); itr != regs.rend(); ++itr)
-                {
-                    if (itr->first < 6)
-                        compressedData.push_back(itr->second);
-                }
-            }
-            else
-            {
-                for (const auto& reg : regs)
-                {
-                    if (reg.first < 6)
-                    {
-                        compressedData.push_back(reg.second); // reg value
-                        ++firstsHalfRegs;
-                    }
-                }
-            }
-            ++stats.firstHalfRegs[firstsHalfRegs];
-            ++stats.secondHalfRegs[regs.size() - firstsHalfRegs];
-
-            uint8_t header2 = makeRegMask(regs, 6, 14);
-            header2 = reverseBits(header2);
-            if (itr == stats.maskIndex.end())
-                compressedData.push_back(header2);
+            data = mappedFile.data();
+            size = mappedFile.size();
+            return true;
+        }
 
-            if ((header2 & 0x7f) == 0 && itr == stats.maskIndex.end())
-            {
-                // play_all branch. Serialize regs in regular order
-                for (auto itr = regs.begin(); itr != regs.end(); ++itr)
-                {
-                    if (itr->first >= 6)
-                        compressedData.push_back(itr->second);
-                }
-            }
-            else
+        std::ifstream fileIn;
+        if (fileName != "-")
+        {
+            fileIn.open(fileName, std::ios::binary);
+            if (!fileIn.is_open())
             {
-                // play_by_mask branch. Serialize regs in backward order
-                for (auto itr = regs.rbegin(); itr != regs.rend(); ++itr)
-                {
-                    if (itr->first >= 6)
-                        compressedData.push_back(itr->second); // reg value
-                }
+                std::cerr << "Can't open input file " << fileName << std::endl;
+                return false;
             }
         }
+#ifdef _WIN32
         else
         {
-            assert(regs.size() == 1);
-            for (const auto& reg : regs)
-            {
-                compressedData.push_back(reg.first + 1);
-                compressedData.push_back(reg.second); // reg value
-                header1 = 0;
-            }
+            _setmode(_fileno(stdin), _O_BINARY);
         }
-
-        stats.ownBytes += compressedData.size() - prevSize;
+#endif
+        std::istream& in = fileIn.is_open() ? fileIn : std::cin;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
     }
+};
 
-    int serializedFrameSize(uint16_t pos)
-    {
-        const uint16_t symbol = ayFrames[pos].symbol;
-        if (symbol <= kMaxDelay)
-            return symbol <= 16 ? 1 : 2;
-
-        auto regs = symbolToRegs[symbol];
-
-        if (isPsg2(regs, symbol, stats))
-        {
-            int headerSize = 2;
-            uint16_t mask = longRegMask(regs);
-            if (stats.maskIndex.count(mask))
-                --headerSize;
-
-            return headerSize + regs.size();
-        }
-
-
-        return regs.size() * 2;
-    };
+/**
+ * Decode the packed data and compare it with the parse result frame by frame.
+ */
+int verifyPacked(const PgsPacker& packer, int level, const PgsPacker::ParsedPsg& parsed, bool verbose)
+{
+    PsgUnpacker unpacker;
+    int result = unpacker.unpack(packer.compressedData, level);
+    if (result == 0)
+        result = unpacker.verify(parsed);
+    if (result != 0)
+        return result;
 
-    bool isFrameCover(const FrameInfo& master, const FrameInfo& slave)
+    if (level >= l4 && unpacker.maxNestedLevel >= PsgUnpacker::kMaxNestedLevel)
     {
-        if (master.symbol == slave.symbol)
-            return true;
+        std::cerr << "Verification failed: nested level " << unpacker.maxNestedLevel
+            << " doesn't fit into MAX_NESTED_LEVEL " << PsgUnpacker::kMaxNestedLevel << " of l4_psg_player.asm" << std::endl;
+        return -1;
+    }
+    if (verbose)
+    {
+        std::cout << "Verified " << unpacker.frames.size() << " frames";
+        if (level >= l4)
+            std::cout << ", the player stack depth " << unpacker.maxNestedLevel + 1 << " of " << PsgUnpacker::kMaxNestedLevel;
+        std::cout << std::endl;
+    }
+    return 0;
+}
 
-        if (stats.level < l1)
-            return false;
+/**
+ * Run the player on the Z80 core over the packed data. It should write the same regs as the decoder
+ * and spend the same time at every frame as the packer timings model expects.
+ */
+int measurePacked(const PgsPacker& packer, int level, const std::string& playerDir, bool verbose)
+{
+    Z80Player player;
+    PsgUnpacker unpacker;
+    if (player.run(Z80Player::playerFileName(playerDir, level), packer.compressedData) != 0)
+        return -1;
+    if (unpacker.unpack(packer.compressedData, level) != 0)
+        return -1;
 
-        if (slave.symbol <= kMaxDelay || master.delta.size() < slave.delta.size())
-            return false;
+    const int frames = std::min(player.frames.size(), unpacker.frames.size());
+    const int regsMismatch = std::mismatch(player.frames.begin(), player.frames.begin() + frames, unpacker.frames.begin()).first
+        - player.frames.begin();
+    if (regsMismatch < frames || player.frames.size() != unpacker.frames.size())
+    {
+        std::cerr << "The player writes other regs than the decoder at frame " << regsMismatch << std::endl;
+        return -1;
+    }
 
-        auto itr = master.delta.begin();
-        for (const auto& reg : slave.delta)
-        {
-            while (itr != master.delta.end() && itr->first < reg.first)
-                ++itr;
-            if (itr == master.delta.end() || itr->first != reg.first || itr->second != reg.second)
-                return false;
-        }
-        for (const auto& reg : master.delta)
+    int pos = 0;
+    int totalTicks = 0;
+    int mismatches = 0;
+    int firstMismatch = -1;
+    for (int i = 0; i < player.timings.size(); ++i)
+    {
+        if (player.timings[i] > player.timings[pos])
+            pos = i;
+        totalTicks += player.timings[i];
+        if (i >= packer.timingsData.size() || player.timings[i] != packer.timingsData[i])
         {
-            if (slave.fullState[reg.first] != reg.second)
-                return false;
+            ++mismatches;
+            if (firstMismatch < 0)
+                firstMismatch = i;
         }
-        if (master.delta.count(13) == 1 && slave.delta.count(13) == 0)
-            return false;
-
-        return true;
     }
-
-    auto findRef(int pos)
+    if (verbose && !player.timings.empty())
     {
-        const int maxLength = std::min(255, (int)ayFrames.size() - pos);
-
-        int maxChainLen = -1;
-        int chainPos = -1;
-        int bestBenifit = 0;
-        int maxReducedLen = -1;
-
-        int maxAllowedReducedLen = stats.level < l4 ? 128 : 255;
-
-        for (int i = 0; i < pos; ++i)
+        std::cout << "Measured on Z80: the longest frame " << player.timings[pos] << "t, pos " << pos
+            << ". Avarage frame: " << totalTicks / player.timings.size() << "t. Looping: " << player.loopTimings << "t" << std::endl;
+    }
+    if (mismatches > 0 || player.timings.size() != packer.timingsData.size())
+    {
+        std::cerr << "Packer timings differ from the player at " << mismatches << " frame(s)";
+        if (firstMismatch >= 0)
         {
-            if (frameOffsets[pos] - frameOffsets[i] + 3 > kMaxRefOffset)
-                continue;
-
-            if (isFrameCover(ayFrames[i], ayFrames[pos]) && refInfo[i].refLen == 0)
-            {
-                int chainLen = 0;
-                int reducedLen = 0;
-                int serializedSize = 0;
-                std::vector<int> sizes;
-
-                for (int j = 0; j < maxLength && i + j < pos && reducedLen < maxAllowedReducedLen; ++j)
-                {
-                    if ((refInfo[i + j].refLen > 1 && stats.level < l4) || !isFrameCover(ayFrames[i + j], ayFrames[pos + j]))
-                        break;
-                    ++chainLen;
-                    const auto& ref = refInfo[i + j];
-                    if (ref.refLen == 0 || (ref.refLen > 1 && ref.refTo >= 0))
-                    {
-                        ++reducedLen;
-                    }
-                    else if (ref.refLen == 1)
-                    {
-                        // Don't count 1-symbol refs during ref serialization for Levels [0..3]
-                        if (stats.level >= l4)
-                            ++reducedLen;
-                    }
-
-                    serializedSize += serializedFrameSize(pos + j);
-                    sizes.push_back(serializedSize);
-                }
-
-                bool truncateLastRef2 = false;
-                while (chainLen > 0 && refInfo[i + chainLen - 1].refLen > 1
-                    && refInfo[i + chainLen - 1].offsetInRef < refInfo[i + chainLen - 1].refLen - 1)
-                {
-                    sizes.pop_back();
-                    --chainLen;
-                    truncateLastRef2 = true;
-                }
-                if (truncateLastRef2)
-                    --reducedLen;
-
-                if (stats.level < l4)
-                {
-                    while (chainLen > 0 && refInfo[i + chainLen - 1].refLen == 1)
-                    {
-                        sizes.pop_back();
-                        --chainLen;
-                    }
-                }
-
-                int benifit = *sizes.rbegin() - (chainLen == 1 ? 2 : 3);
-                if (benifit > bestBenifit)
-                {
-                    bestBenifit = benifit;
-                    maxChainLen = chainLen;
-                    maxReducedLen = reducedLen;
-                    chainPos = i;
-                }
-            }
+            std::cerr << ". The first is frame " << firstMismatch << ": measured " << player.timings[firstMismatch] << "t, expected ";
+            if (firstMismatch < packer.timingsData.size())
+                std::cerr << packer.timingsData[firstMismatch] << "t";
+            else
+                std::cerr << "no frame";
         }
-        if (stats.level < l2)
-        {
-            if (maxChainLen > 1)
-            {
+        std::cerr << std::endl;
+        return -1;
+    }
+    return 0;
+}
 
-                const auto symbol = ayFrames[chainPos].symbol;
-                const auto regs = symbolToRegs[symbol];
-                int t = th.pl0xTimings(regs, symbol);
-                int overrun = (168 - 141) - (661 - t);
-                if (overrun > 0)
-                    return std::tuple<int, int, int> { -1, -1, -1}; //< Long refs is slower
-            }
-        }
+/**
+ * Parse, pack and write one file. The packer is reset first.
+ */
+int packFile(PgsPacker& packer, const PackOptions& options, const CliOptions& cli, const std::string& inputFileName,
+    const std::string& outputFileName, bool verbose)
+{
+    packer.reset();
+    packer.setOptions(options);
 
-        return std::tuple<int, int, int> { chainPos, maxChainLen, maxReducedLen - 1};
-    }
+    int result = packer.parsePsg(inputFileName);
+    if (result == 0)
+        result = packParsed(packer);
+    if (result == 0 && cli.verify)
+        result = verifyPacked(packer, packer.stats.level, packer.parsed(), verbose);
+    if (result == 0 && cli.measure)
+        result = measurePacked(packer, packer.stats.level, cli.playerDir, verbose);
+    if (result == 0)
+        result = writeOutputFiles(packer, outputFileName);
+    return result;
+}
 
-public:
+/**
+ * Pack the file at every level with and without regs cleaning and keep the smallest result
+ * that fits into 'options.timeLimit' (if it is set). The input is parsed once with and once without
+ * regs cleaning, all levels share the parse result. The best packer is returned in 'packer'.
+ */
+int packAuto(std::unique_ptr<PgsPacker>& packer, const PackOptions& options, int workers,
+    const InputData& input, bool verbose)
+{
+    const int kLevels = 6;
+    struct Candidate
+    {
+        PackOptions options;
+        int parseGroup = 0;
+        std::unique_ptr<PgsPacker> packer;
+        int result = -1;
+        int size = 0;
+        int longestFrame = 0;
+    };
 
-    void updateRefInfo(int i, int pos, int len, int reducedLen)
+    std::vector<Candidate> candidates;
+    std::vector<PackOptions> groupOptions(2);
+    for (int clean = 1; clean >= 0; --clean)
     {
-        refInfo[i].refTo = pos;
-        refInfo[i].reducedLen = reducedLen;
-        for (int j = i; j < i + len; ++j)
-        {
-            assert(refInfo[j].refLen == 0);
-            refInfo[j].refLen = len;
-            refInfo[j].offsetInRef = j - i;
+        for (int level = 0; level < kLevels; ++level)
+        {
+            Candidate candidate;
+            candidate.options = options;
+            candidate.options.level = (CompressionLevel) level;
+            candidate.options.timeLimit = 0; //< The time is checked after packing.
+            candidate.options.threads = 1;
+            if (clean)
+                candidate.options.flags |= cleanRegs;
+            else
+                candidate.options.flags &= ~cleanRegs;
+            candidate.parseGroup = clean;
+            candidate.packer.reset(new PgsPacker());
+            groupOptions[candidate.parseGroup] = candidate.options;
+            candidates.push_back(std::move(candidate));
         }
-        if (len > 1)
-            updateNestedLevel(pos, len, 1);
     }
 
-    void updateNestedLevel(int pos, int len, int level)
-    {
-        for (int j = pos; j < pos + len; ++j)
-            refInfo[j].level = std::max(refInfo[j].level, level);
-        for (int j = pos; j < pos + len; ++j)
+    std::vector<PgsPacker::ParsedPsg> parsed(groupOptions.size());
+    std::vector<int> parseResults(groupOptions.size(), -1);
+    std::vector<Profile> parseProfiles(groupOptions.size());
+    ThreadPool pool(std::max(1, std::min(workers, (int) candidates.size())));
+    std::atomic<int> nextTask{ 0 };
+    pool.run(
+        [&](int)
         {
-            if (refInfo[j].refTo >= 0 && refInfo[j].refLen > 1)
-                updateNestedLevel(refInfo[j].refTo, refInfo[j].refLen, level + 1);
-        }
-    }
+            PgsPacker parser;
+            for (int i = nextTask++; i < groupOptions.size(); i = nextTask++)
+            {
+                parser.reset();
+                parser.setOptions(groupOptions[i]);
+                parseResults[i] = parser.parsePsg(input.data, input.size);
+                parsed[i] = parser.parsed();
+                parseProfiles[i].merge(parser.profile);
+            }
+        });
 
-    int cutDelay(const CutRange& range, int v)
-    {
-        if (!range.isEmpty())
+    nextTask = 0;
+    pool.run(
+        [&](int)
         {
-            v = std::min(range.to - stats.inPsgFrames, v);
-            if (stats.inPsgFrames < range.from)
+            for (int i = nextTask++; i < candidates.size(); i = nextTask++)
             {
-                if (stats.inPsgFrames + v >= range.from)
-                    v = std::min(range.from - stats.inPsgFrames, v);
-                else
-                    v = 0;
+                auto& candidate = candidates[i];
+                if (parseResults[candidate.parseGroup] != 0)
+                    continue;
+                candidate.packer->setOptions(candidate.options);
+                candidate.packer->loadParsed(parsed[candidate.parseGroup]);
+                candidate.result = packParsed(*candidate.packer);
+                candidate.size = candidate.packer->compressedData.size();
+                candidate.longestFrame = candidate.packer->longestFrame();
             }
-        }
-        return v;
-    }
+        });
 
-    int parsePsg(const std::string& inputFileName)
+    Candidate* best = nullptr;
+    for (auto& candidate : candidates)
     {
-        using namespace std;
-
-        ifstream fileIn;
-        fileIn.open(inputFileName, std::ios::binary);
-        if (!fileIn.is_open())
+        if (candidate.result != 0)
+            continue;
+        const bool inTime = options.timeLimit == 0 || candidate.longestFrame <= options.timeLimit;
+        if (verbose)
         {
-            std::cerr << "Can't open input file " << inputFileName << std::endl;
-            return -1;
+            std::cout << "Level " << candidate.options.level << ((candidate.options.flags & cleanRegs) ? " --clean" : " --keep")
+                << ":\t" << candidate.size << " bytes, the longest frame " << candidate.longestFrame << "t"
+                << (inTime ? "" : ", too slow") << std::endl;
         }
+        if (inTime && (!best || candidate.size < best->size))
+            best = &candidate;
+    }
+    if (!best)
+    {
+        std::cerr << "Can't fit into " << options.timeLimit << "t at any level" << std::endl;
+        return -1;
+    }
 
-        fileIn.seekg(0, ios::end);
-        int fileSize = fileIn.tellg();
-        fileIn.seekg(0, ios::beg);
+    if (verbose)
+    {
+        std::cout << "Selected level " << best->options.level
+            << ((best->options.flags & cleanRegs) ? " --clean" : " --keep") << std::endl;
+    }
+    best->packer->profile.merge(parseProfiles[best->parseGroup]);
+    packer = std::move(best->packer);
+    return 0;
+}
 
-        srcPsgData.resize(fileSize);
-        fileIn.read((char*)srcPsgData.data(), fileSize);
-        firstFrame = true;
+/**
+ * Numbers printed after packing. They are stored in the cache along with the packed data.
+ */
+struct PackSummary
+{
+    int level = 0;
+    int flags = 0;
+    uint64_t inputSize = 0;
+    int packedFrames = 0;
+    int emptyFrames = 0;
+    int singleRepeat = 0;
+    int allRepeat = 0;
+    int allRepeatFrames = 0;
+    int totalFrames = 0;
+    int nestedLevel = 0;
+    bool cached = false; //< Taken from the cache, the packer profile is empty.
 
-        const uint8_t* pos = srcPsgData.data() + 16;
-        const uint8_t* end = srcPsgData.data() + srcPsgData.size();
+    static PackSummary of(const PgsPacker& packer)
+    {
+        PackSummary result;
+        result.level = packer.stats.level;
+        result.flags = packer.flags;
+        result.inputSize = packer.inputSize;
+        result.packedFrames = packer.ayFrames.size();
+        result.emptyFrames = packer.stats.emptyCnt;
+        result.singleRepeat = packer.stats.singleRepeat;
+        result.allRepeat = packer.stats.allRepeat;
+        result.allRepeatFrames = packer.stats.allRepeatFrames;
+        result.totalFrames = packer.stats.outPsgFrames;
+        result.nestedLevel = packer.maxNestedLevel();
+        return result;
+    }
+};
 
-        for (int i = 0; i <= kMaxDelay; ++i)
-        {
-            RegMap fakeRegs;
-            fakeRegs[-1] = i;
-            regsToSymbol.emplace(fakeRegs, i);
-            symbolToRegs.emplace(i, fakeRegs);
-        }
+/**
+ * On disk cache of packed files. The entry name is a hash of the source data, the options that affect
+ * the result and the packer version. An entry keeps the packed data, the timings, the PSG dump and the summary.
+ */
+class PackCache
+{
+public:
+    PackCache(const std::string& dir) : m_dir(dir) {}
 
-        int delayCounter = 0;
+    /** Find the entry. Fill the packer output data and the summary on hit. */
+    bool load(const InputData& input, const PackOptions& options, bool autoMode, PgsPacker& packer, PackSummary& summary) const
+    {
+        const auto key = makeKey(options, autoMode, input.size);
+        std::ifstream fileIn(entryName(input, key), std::ios::binary);
+        if (!fileIn.is_open())
+            return false;
 
+        std::string storedKey;
+        if (!readBytes(fileIn, storedKey) || storedKey != key)
+            return false; //< Hash collision or other format version.
 
-        CutRange range;
-        if (!cutRanges.empty())
+        std::vector<int> values;
+        std::vector<uint8_t> compressedData, updatedPsgData;
+        std::vector<int> timingsData;
+        if (!readValues(fileIn, values) || values.size() != 9
+            || !readBytes(fileIn, compressedData) || !readValues(fileIn, timingsData) || !readBytes(fileIn, updatedPsgData))
         {
-            range = cutRanges[0];
-            cutRanges.erase(cutRanges.begin());
+            return false;
         }
 
-        while (pos < end)
-        {
-            if (!range.isEmpty() && stats.inPsgFrames >= range.to)
-            {
-                if (!cutRanges.empty())
-                {
-                    range = cutRanges[0];
-                    cutRanges.erase(cutRanges.begin());
-                    continue;
-                }
-                else
-                {
-                    break;
-                }
-            }
+        summary.level = values[0];
+        summary.flags = values[1];
+        summary.inputSize = input.size;
+        summary.packedFrames = values[2];
+        summary.emptyFrames = values[3];
+        summary.singleRepeat = values[4];
+        summary.allRepeat = values[5];
+        summary.allRepeatFrames = values[6];
+        summary.totalFrames = values[7];
+        summary.nestedLevel = values[8];
+
+        packer.reset();
+        packer.setOptions(options);
+        packer.stats.level = (CompressionLevel) summary.level;
+        packer.flags = (options.flags & ~cleanRegs) | (summary.flags & cleanRegs); //< Auto mode selects cleaning.
+        packer.inputSize = input.size;
+        packer.compressedData = std::move(compressedData);
+        packer.timingsData = std::move(timingsData);
+        packer.updatedPsgData = std::move(updatedPsgData);
+        return true;
+    }
 
-            uint8_t value = *pos;
-            if (value >= 0xfe)
-            {
-                bool needSkip = !range.isEmpty() && stats.inPsgFrames < range.from;
-                if (!changedRegs.empty())
-                {
-                    if (!needSkip)
-                    {
-                        if (!writeRegs())
-                            ++delayCounter; //< Regs were cleaned up.
-                    }
-                }
+    /** Store the packer result. Call it before the timings are changed by writeTimingsFile. */
+    void store(const InputData& input, const PackOptions& options, bool autoMode, const PgsPacker& packer, const PackSummary& summary) const
+    {
+        namespace fs = std::filesystem;
+
+        const auto key = makeKey(options, autoMode, input.size);
+        const auto name = entryName(input, key);
+        std::error_code error;
+        fs::create_directories(m_dir, error);
+
+        // Write a temporary file and rename it, so concurrent readers never see a partial entry.
+        const auto tempName = name + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        {
+            std::ofstream fileOut(tempName, std::ios::binary | std::ios::trunc);
+            if (!fileOut.is_open())
+                return;
+            const std::vector<int> values = { summary.level, summary.flags, summary.packedFrames, summary.emptyFrames,
+                summary.singleRepeat, summary.allRepeat, summary.allRepeatFrames, summary.totalFrames, summary.nestedLevel };
+            writeBytes(fileOut, key);
+            writeValues(fileOut, values);
+            writeBytes(fileOut, packer.compressedData);
+            writeValues(fileOut, packer.timingsData);
+            writeBytes(fileOut, packer.updatedPsgData);
+            if (!fileOut)
+                return;
+        }
+        fs::rename(tempName, name, error);
+        if (error)
+            fs::remove(tempName, error);
+    }
 
-                if (value == 0xff)
-                {
-                    if (!needSkip)
-                        ++delayCounter;
-                    ++stats.inPsgFrames;
-                    ++pos;
-                }
-                else
-                {
-                    int v = pos[1] * 4;
-                    v = cutDelay(range, v);
-                    stats.inPsgFrames += pos[1] * 4;
-                    delayCounter += v;
-                    pos += 2;
-                }
-            }
-            else if (value == 0xfd)
-            {
-                break;
-            }
-            else
-            {
-                writeDelay(delayCounter - 1);
-                delayCounter = 0;
-
-                assert(value <= 13);
-                changedRegs[value] = pos[1];
-                lastOrigRegs[value] = pos[1];
-                ++stats.regsChange[value];
-                pos += 2;
-            }
-        }
+private:
+    /** Everything except the source data that affects the result. Auto mode selects the level and cleaning. */
+    static std::string makeKey(const PackOptions& options, bool autoMode, size_t inputSize)
+    {
+        const int ignoredFlags = dumpTimings; //< Timings are always stored.
+        std::ostringstream key;
+        key << "psg_pack " << kPackerVersion << " algorithm " << kPackAlgorithmVersion << " cache " << kCacheFormat
+            << " level " << options.level << " auto " << autoMode << " flags " << (options.flags & ~ignoredFlags)
+            << " max-t " << options.timeLimit << " lazy " << options.lazySteps << " size " << inputSize << " cut";
+        for (const auto& range : options.cutRanges)
+            key << " " << range.from << "," << range.to;
+        return key.str();
+    }
 
-        if (!changedRegs.empty())
-        {
-            if (!writeRegs())
-                ++delayCounter; //< Regs were cleaned up.
-        }
-        delayCounter = cutDelay(range, delayCounter);
-        writeDelay(delayCounter);
-
-        for (const auto& v: stats.maskToUsage)
-            stats.usageToMask.emplace(v.second, v.first);
-        while (stats.usageToMask.size() > kPsg2iSize)
-            stats.usageToMask.erase(stats.usageToMask.begin());
-        stats.maskToUsage.clear();
-        int i = 0;
-        for (const auto& v: stats.usageToMask)
-        {
-            stats.maskToUsage[v.second] = v.first;
-            stats.maskIndex[v.second] = i++;
-        }
+    std::string entryName(const InputData& input, const std::string& key) const
+    {
+        const uint64_t keyHash = hash64(key.data(), key.size(), 0);
+        const uint64_t hash1 = hash64(input.data, input.size, keyHash);
+        const uint64_t hash2 = hash64(input.data, input.size, ~keyHash);
 
-        return 0;
+        std::ostringstream name;
+        name << std::hex << std::setfill('0') << std::setw(16) << hash1 << std::setw(16) << hash2 << ".cache";
+        return (std::filesystem::path(m_dir) / name.str()).string();
     }
 
-    int packPsg(const std::string& outputFileName)
+    /** MurmurHash64A */
+    static uint64_t hash64(const void* data, size_t size, uint64_t seed)
     {
-        using namespace std;
-
-        ofstream fileOut;
-        fileOut.open(outputFileName, std::ios::binary | std::ios::trunc);
-        if (!fileOut.is_open())
-        {
-            std::cerr << "Can't open output file " << outputFileName << std::endl;
-            return -1;
-        }
+        const uint64_t m = 0xc6a4a7935bd1e995ull;
+        const int r = 47;
+        uint64_t h = seed ^ (size * m);
 
-        compressedData.resize(kPsg2iSize * 2);
-        for (const auto& value: stats.maskIndex)
+        const uint8_t* pos = (const uint8_t*) data;
+        const uint8_t* end = pos + size / 8 * 8;
+        for (; pos != end; pos += 8)
         {
-            const int offset = value.second * 2;
-            compressedData[offset] = (uint8_t)value.first;
-            compressedData[offset+1] = (value.first >> 8);
+            uint64_t k;
+            memcpy(&k, pos, 8);
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
         }
 
-        // compressData
-        refInfo.resize(ayFrames.size());
-
-        for (int i = 0; i < ayFrames.size();)
+        const int tail = size & 7;
+        if (tail)
         {
-            while (frameOffsets.size() <= i)
-                frameOffsets.push_back(compressedData.size());
-
-            if (ayFrames[i].symbol <= kMaxDelay)
-            {
-                serializeDelay(ayFrames[i].symbol);
-                stats.emptyFrames += ayFrames[i].symbol;
-                ++stats.emptyCnt;
-                ++i;
-            }
-            else
-            {
-                const auto symbol = ayFrames[i].symbol;
-
-                const auto [pos, len, reducedLen] = findRef(i);
-                if (len > 0)
-                {
-                    serializeRef(pos, len, reducedLen);
-                    updateRefInfo(i, pos, len, reducedLen);
-
-                    i += len;
-                    if (len == 1)
-                        stats.singleRepeat++;
-                    stats.allRepeat++;
-                    stats.allRepeatFrames += len;
-                }
-                else
-                {
-                    serializeFrame(i);
-                    ++i;
-                    ++stats.ownCnt;
-                }
-            }
+            uint64_t k = 0;
+            for (int i = tail - 1; i >= 0; --i)
+                k = (k << 8) | pos[i];
+            h ^= k;
+            h *= m;
         }
 
-        compressedData.push_back(kEndTrackMarker);
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
 
-        for (const auto& v : symbolToRegs)
-            ++stats.frameRegs[v.second.size()];
+    static void writeSize(std::ostream& out, uint32_t value)
+    {
+        const uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+        out.write((const char*) bytes, 4);
+    }
 
+    static bool readSize(std::istream& in, uint32_t& value)
+    {
+        uint8_t bytes[4];
+        if (!in.read((char*) bytes, 4))
+            return false;
+        value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+        return true;
+    }
 
-        fileOut.write((const char*)compressedData.data(), compressedData.size());
-        fileOut.close();
+    template <typename T>
+    static void writeBytes(std::ostream& out, const T& data)
+    {
+        writeSize(out, data.size());
+        out.write((const char*) data.data(), data.size());
+    }
 
-        return 0;
+    template <typename T>
+    static bool readBytes(std::istream& in, T& data)
+    {
+        uint32_t size = 0;
+        if (!readSize(in, size))
+            return false;
+        data.resize(size);
+        return size == 0 || in.read((char*) &data[0], size);
     }
 
-    int writeRawPsg(const std::string& outputFileName)
+    static void writeValues(std::ostream& out, const std::vector<int>& values)
     {
-        using namespace std;
+        writeSize(out, values.size());
+        for (int value : values)
+            writeSize(out, value);
+    }
 
-        ofstream fileOut;
-        fileOut.open(outputFileName, std::ios::binary | std::ios::trunc);
-        if (!fileOut.is_open())
+    static bool readValues(std::istream& in, std::vector<int>& values)
+    {
+        uint32_t size = 0;
+        if (!readSize(in, size))
+            return false;
+        values.resize(size);
+        for (auto& value : values)
         {
-            std::cerr << "Can't open output file " << outputFileName << std::endl;
-            return -1;
+            uint32_t v = 0;
+            if (!readSize(in, v))
+                return false;
+            value = (int) v;
         }
+        return true;
+    }
 
-        fileOut.write((const char*) updatedPsgData.data(), updatedPsgData.size());
+    static const int kCacheFormat = 2; //< Change it if the entry format changes. Packed output changes bump kPackAlgorithmVersion.
+    std::string m_dir;
+};
 
-        return 0;
+/**
+ * Pack one input file with all the mode options: auto mode and the cache. 'summary' is filled on success.
+ */
+int packInput(std::unique_ptr<PgsPacker>& packer, const PackOptions& options, int workers, const CliOptions& cli,
+    const std::string& inputFileName, const std::string& outputFileName, PackSummary& summary, bool verbose)
+{
+    const auto& cacheDir = cli.cacheDir;
+    int result = 0;
+    if (cacheDir.empty() && !cli.autoMode)
+    {
+        // Stream the input.
+        result = packFile(*packer, options, cli, inputFileName, outputFileName, verbose);
+        if (result == 0)
+            summary = PackSummary::of(*packer);
+        return result;
     }
 
-    int writeTimingsFile(const std::string& outputFileName)
+    InputData input;
+    if (!input.open(inputFileName))
+        return -1;
+
+    PackCache cache(cacheDir);
+    if (!cacheDir.empty() && cache.load(input, options, cli.autoMode, *packer, summary))
     {
-        if (flags & addScf)
-        {
-            for (auto& t: timingsData)
-                t += 4;
+        if (verbose)
+        {
+            std::cout << "Found in the cache" << std::endl;
+            if (cli.autoMode)
+                std::cout << "Selected level " << summary.level << ((summary.flags & cleanRegs) ? " --clean" : " --keep") << std::endl;
+        }
+        summary.cached = true;
+        if (cli.verify)
+        {
+            // The cache keeps the packed data only. Parse the input again to compare with.
+            PgsPacker parser;
+            parser.setOptions(packer->options());
+            result = parser.parsePsg(input.data, input.size);
+            if (result == 0)
+                result = verifyPacked(*packer, summary.level, parser.parsed(), verbose);
+            if (result != 0)
+                return result;
         }
-
-        using namespace std;
-
-        ofstream fileOut;
-        fileOut.open(outputFileName, std::ios::trunc);
-        if (!fileOut.is_open())
-        {
-            std::cerr << "Can't open output file " << outputFileName << std::endl;
+        if (cli.measure && measurePacked(*packer, summary.level, cli.playerDir, verbose) != 0)
             return -1;
-        }
-
-        fileOut << "frame; timings; with call" << std::endl;
-        for (int i = 0; i < timingsData.size(); ++i)
-        {
-            fileOut << i << ";" << timingsData[i] << ";" << timingsData[i]+10 << ";" << std::endl;
-            
-        }
-
-        return 0;
+        return writeOutputFiles(*packer, outputFileName);
     }
 
-    int maxNestedLevel() const 
+    if (cli.autoMode)
+    {
+        result = packAuto(packer, options, workers, input, verbose);
+    }
+    else
     {
-        int result = 0;
-        for (const auto& ref : refInfo)
-            result = std::max(result, ref.level);
+        packer->reset();
+        packer->setOptions(options);
+        result = packer->parsePsg(input.data, input.size);
+        if (result == 0)
+            result = packParsed(*packer);
+    }
+    if (result != 0)
         return result;
-    }       
 
-    private:
-        int lastDelayValue = 0;
-        int lastDelayBytes = 0;
+    if (cli.verify)
+    {
+        result = verifyPacked(*packer, packer->stats.level, packer->parsed(), verbose);
+        if (result != 0)
+            return result;
+    }
+    if (cli.measure && measurePacked(*packer, packer->stats.level, cli.playerDir, verbose) != 0)
+        return -1;
 
-};
+    summary = PackSummary::of(*packer);
+    if (!cacheDir.empty())
+        cache.store(input, options, cli.autoMode, *packer, summary);
+    return writeOutputFiles(*packer, outputFileName);
+}
 
-bool hasShortOpt(const std::string& s, char option)
+void printProfile(const PgsPacker& packer, const PackSummary& summary)
 {
-    if (s.size() >= 2 && s[0] == '-' && s[1] == '-')
-        return false;
-    if (s.empty() || s[0] != '-')
-        return false;
-    return s.find(option) != std::string::npos;
+    if (summary.cached)
+        std::cout << "The result is taken from the cache, there is nothing to profile." << std::endl;
+    else
+        packer.printProfile(std::cout);
 }
 
-CutRange parseRange(const std::string& value)
+/** JSON object of one file for --profile-json. */
+std::string profileJson(const PgsPacker& packer, const PackSummary& summary, const std::string& inputFileName)
 {
-    CutRange result;
-    int pos = value.find(',');
-    if (pos == -1)
+    std::string fileName;
+    for (char c : inputFileName)
     {
-        result.to = std::stoi(value);
+        if (c == '"' || c == '\\')
+            fileName += '\\';
+        fileName += c;
     }
-    else
+
+    std::ostringstream out;
+    out << "    {" << std::endl;
+    out << "      \"file\": \"" << fileName << "\"," << std::endl;
+    out << "      \"level\": " << summary.level << "," << std::endl;
+    out << "      \"cached\": " << (summary.cached ? "true" : "false") << "," << std::endl;
+    out << "      \"profile\": ";
+    packer.writeProfileJson(out, "      ");
+    out << std::endl << "    }";
+    return out.str();
+}
+
+int writeProfileJson(const std::string& outputFileName, const std::vector<std::string>& files)
+{
+    std::ofstream fileOut(outputFileName, std::ios::trunc);
+    if (!fileOut.is_open())
     {
-        auto s1 = value.substr(0, pos);
-        auto s2 = value.substr(pos+1);
-        result.from = std::stoi(s1);
-        result.to = std::stoi(s2);
+        std::cerr << "Can't open output file " << outputFileName << std::endl;
+        return -1;
     }
-    return result;
+    fileOut << "{" << std::endl;
+    fileOut << "  \"packerVersion\": \"" << kPackerVersion << "\"," << std::endl;
+    fileOut << "  \"files\": [" << std::endl;
+    for (int i = 0; i < files.size(); ++i)
+        fileOut << files[i] << (i + 1 < files.size() ? "," : "") << std::endl;
+    fileOut << "  ]" << std::endl;
+    fileOut << "}" << std::endl;
+    return 0;
 }
 
-int parseArgs(int argc, char** argv, PgsPacker* packer)
+/**
+ * Batch source is a directory (all *.psg files in it) or a text file with a file name per line.
+ */
+int listBatchFiles(const std::string& source, std::vector<std::string>& files)
 {
-    for (int i = 1; i < argc - 2; ++i)
+    namespace fs = std::filesystem;
+
+    std::error_code error;
+    if (fs::is_directory(source, error))
     {
-        const std::string s = argv[i];
-        if (hasShortOpt(s, 'l') || s == "--level")
-        {
-            if (i == argc - 1)
-            {
-                std::cerr << "It need to define compression leven in range [0..4] after the argument '--level'" << std::endl;
-                return -1;
-            }
-            int value = atoi(argv[i + 1]);
-            if (value < 0 || value > 5)
-            {
-                std::cerr << "Invalid compression level " << value << ". Expected value in range [0..5]" << std::endl;
-                return -1;
-            }
-            packer->stats.level = (CompressionLevel)value;
-        }
-        if (s == "--cut")
-        {
-            if (i == argc - 1)
-            {
-                std::cerr << "It need to define cut value in frames after the argument '--cut'. Example: 0,1000." << std::endl;
-                return -1;
-            }
-            auto range = parseRange(argv[i + 1]);
-            packer->cutRanges.push_back(range);
-        }
-        if (hasShortOpt(s, 'c') || s == "--clean")
-        {
-            packer->flags |= cleanRegs;
-        }
-        if (hasShortOpt(s, 'k') || s == "--keep")
-        {
-            packer->flags &= ~cleanRegs;
-        }
-        if (hasShortOpt(s, 'd') || s == "--dump")
-        {
-            packer->flags |= dumpPsg;
-        }
-        if (hasShortOpt(s, 'i') || s == "--info")
-        {
-            packer->flags |= dumpTimings;
-        }
-        if (s == "--scf")
+        for (const auto& entry : fs::directory_iterator(source, error))
         {
-            // Undocumented option. Ensure 'c' flag is always on after the player. This option affects timings calculating only. It reffers to the internal player version from zx_scrool
-            packer->flags |= addScf;
-            packer->stats.addScf = true;
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (entry.is_regular_file(error) && extension == ".psg")
+                files.push_back(entry.path().string());
         }
+        std::sort(files.begin(), files.end());
+        return 0;
+    }
+
+    std::ifstream fileIn(source);
+    if (!fileIn.is_open())
+    {
+        std::cerr << "Can't open batch list " << source << std::endl;
+        return -1;
+    }
+    std::string line;
+    while (std::getline(fileIn, line))
+    {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+        if (!line.empty() && line[0] != '#')
+            files.push_back(line);
     }
     return 0;
 }
 
+/**
+ * Pack all files from the batch source into 'outputDir'. Every worker owns a packer and reuses its buffers.
+ * Workers take the next file from the shared queue, largest files go first.
+ */
+int packBatch(const PackOptions& options, int workers, const CliOptions& cli, const std::string& source, const std::string& outputDir)
+{
+    namespace fs = std::filesystem;
+    using namespace std::chrono;
+
+    std::vector<std::string> files;
+    if (listBatchFiles(source, files) != 0)
+        return -1;
+
+    std::error_code error;
+    fs::create_directories(outputDir, error);
+    if (!fs::is_directory(outputDir, error))
+    {
+        std::cerr << "Can't create output directory " << outputDir << std::endl;
+        return -1;
+    }
+
+    struct Task
+    {
+        std::string inputFileName;
+        uintmax_t size = 0;
+    };
+    std::vector<Task> tasks;
+    for (const auto& file : files)
+    {
+        const auto size = fs::file_size(file, error);
+        tasks.push_back({ file, error ? 0 : size });
+    }
+    std::stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) { return a.size > b.size; });
+
+    PackOptions workerOptions = options;
+    workerOptions.threads = 1;
+    workers = std::max(1, std::min(workers, (int) tasks.size()));
+
+    std::atomic<int> nextTask{ 0 };
+    std::mutex outputMutex;
+    int failed = 0;
+    size_t totalInput = 0;
+    size_t totalPacked = 0;
+    int longestFrame = 0;
+    std::string longestFrameFile;
+    double packTime = 0;
+    std::vector<std::string> profiles;
+
+    const auto timeBegin = steady_clock::now();
+    ThreadPool pool(workers);
+    pool.run(
+        [&](int)
+        {
+            std::unique_ptr<PgsPacker> packer(new PgsPacker());
+            for (int i = nextTask++; i < tasks.size(); i = nextTask++)
+            {
+                const auto& inputFileName = tasks[i].inputFileName;
+                const auto outputFileName = (fs::path(outputDir) / fs::path(inputFileName).stem()).string() + ".mus";
+
+                const auto fileBegin = steady_clock::now();
+                PackSummary summary;
+                const int result = packInput(packer, workerOptions, 1, cli, inputFileName, outputFileName, summary, false);
+                const double seconds = duration_cast<milliseconds>(steady_clock::now() - fileBegin).count() / 1000.0;
+                const int t = packer->longestFrame();
+
+                std::lock_guard<std::mutex> lock(outputMutex);
+                packTime += seconds;
+                if (result != 0)
+                {
+                    ++failed;
+                    std::cout << inputFileName << "\tFAILED" << std::endl;
+                    continue;
+                }
+                totalInput += summary.inputSize;
+                totalPacked += packer->compressedData.size();
+                if (t > longestFrame)
+                {
+                    longestFrame = t;
+                    longestFrameFile = inputFileName;
+                }
+                const double ratio = summary.inputSize ? 100.0 * packer->compressedData.size() / summary.inputSize : 0;
+                std::ostringstream line;
+                line << inputFileName << "\t" << summary.inputSize << " -> " << packer->compressedData.size()
+                    << "\t" << std::fixed << std::setprecision(1) << ratio << "%\t" << t << "t\t"
+                    << std::setprecision(3) << seconds << "s";
+                if (cli.autoMode)
+                    line << "\tlevel " << summary.level << ((summary.flags & cleanRegs) ? " --clean" : " --keep");
+                std::cout << line.str() << std::endl;
+                if (cli.profile)
+                    printProfile(*packer, summary);
+                if (!cli.profileFileName.empty())
+                    profiles.push_back(profileJson(*packer, summary, inputFileName));
+            }
+        });
+    const double seconds = duration_cast<milliseconds>(steady_clock::now() - timeBegin).count() / 1000.0;
+
+    std::cout << "Batch done in " << seconds << " second(s), " << workers << " worker(s)" << std::endl;
+    std::cout << "Packed files:\t" << tasks.size() - failed << std::endl;
+    std::cout << "Failed files:\t" << failed << std::endl;
+    std::cout << "Input size:\t" << totalInput << std::endl;
+    std::cout << "Packed size:\t" << totalPacked << std::endl;
+    if (totalInput > 0)
+        std::cout << "Ratio:\t\t" << std::round(1000.0 * totalPacked / totalInput) / 10 << "%" << std::endl;
+    if (!longestFrameFile.empty())
+        std::cout << "The longest frame: " << longestFrame << "t, " << longestFrameFile << std::endl;
+    std::cout << "Sum of pack times: " << packTime << " second(s)" << std::endl;
+
+    if (!cli.profileFileName.empty() && writeProfileJson(cli.profileFileName, profiles) != 0)
+        return -1;
+    return failed == 0 ? 0 : -1;
+}
+
 int main(int argc, char** argv)
 {
     std::unique_ptr<PgsPacker> packer(new PgsPacker());
 
-    std::cout << "Fast PSG packer v.0.9b" << std::endl;
+    std::cout << "Fast PSG packer v." << kPackerVersion << std::endl;
     if (argc < 3)
     {
         std::cout << "Usage: psg_pack [OPTION] input_file output_file" << std::endl;
         std::cout << "Example: psg_pack --level 1 file1.psg packetd.mus" << std::endl;
+        std::cout << "Use '-' as input_file to read PSG from stdin." << std::endl;
+        std::cout << "Batch usage: psg_pack --batch [OPTION] <input_dir|list_file> output_dir" << std::endl;
         std::cout << "Recomended compression levels are level 1 (fast play, up to 799t) and level 4 (small size, up to 930t)" << std::endl;
         std::cout << "Default options: --level 1 --clean" << std::endl;
         std::cout << "" << std::endl;
@@ -1518,62 +1049,61 @@ int main(int argc, char** argv)
         std::cout << "-k, --keep\t --Don't clean AY regiaters." << std::endl;
         std::cout << "-i, --info\t Print timings info for each compresed frame." << std::endl;
         std::cout << "-d, --dump\t Dump uncompressed PSG frame to the separate file." << std::endl;
+        std::cout << "--optimal\t Find the shortest serialization instead of the greedy one. It is slower." << std::endl;
+        std::cout << "--max-t <N>\t Max frame time in t-states. Select refs that fit into it. It turns on '--optimal' mode." << std::endl;
+        std::cout << "--repack-mask-index\t Choose the mask index again by the frames serialized as is and repack. Saves about 0.1%, packing takes about twice longer." << std::endl;
+        std::cout << "--lazy <N>\t Lazy matching: serialize a frame as is if a ref up to N frames later (1 or 2) is better. Default is 0." << std::endl;
+        std::cout << "--threads <N>\t Use N threads for the reference search. The result doesn't depend on threads count." << std::endl;
+        std::cout << "--auto\t\t Pack at every level with and without '--clean' and keep the smallest result." << std::endl;
+        std::cout << "\t\t With '--max-t <N>' keep the smallest result with the longest frame up to N t-states." << std::endl;
+        std::cout << "\t\t Candidates are packed in parallel, '--threads <N>' sets the number of them packed at once." << std::endl;
+        std::cout << "--batch\t\t Pack all *.psg files from the input directory, or files listed in the input text file, into the output directory." << std::endl;
+        std::cout << "\t\t Files are packed in parallel. '--threads <N>' sets the number of files packed at once, default is the number of CPU cores." << std::endl;
+        std::cout << "--profile\t Print the packer counters: parse and pack time, ref candidates, cover checks, repack passes, symbols." << std::endl;
+        std::cout << "--profile-json <file>\t Write the packer counters to the JSON file. In batch mode there is an entry per file." << std::endl;
+        std::cout << "--verify\t Decode the packed data as the player does and compare it with the source frames before writing." << std::endl;
+        std::cout << "--measure\t Run the player on a Z80 emulator over the packed data, measure every frame and compare it with the packer timings." << std::endl;
+        std::cout << "--player-dir <dir>\t Directory of fast_psg_player.asm and l4_psg_player.asm for '--measure'. Default is '" PSG_PACK_PLAYER_DIR "'." << std::endl;
+        std::cout << "--cache-dir <dir>\t Keep packed files in the directory. A file packed again with the same options is taken from it." << std::endl;
         std::cout << "--cut <range>\t Cut source track. Include frames [N1..N2). Example: --cut 0,1000. The option '--cut <range>' can be repeated several times." << std::endl;
         return -1;
     }
     
-    int result = parseArgs(argc, argv, packer.get());
+    CliOptions cli;
+    int result = parseArgs(argc, argv, packer.get(), cli);
     if (result != 0)
         return result;
 
     using namespace std::chrono;
 
-    std::cout << "Starting compression at level " << packer->stats.level << std::endl;
+    const PackOptions options = packer->options();
+    if (!cli.autoMode)
+        std::cout << "Starting compression at level " << packer->stats.level << std::endl;
+    int workers = std::max(1u, std::thread::hardware_concurrency());
+    if (std::find(argv + 1, argv + argc - 2, std::string("--threads")) != argv + argc - 2)
+        workers = options.threads;
+    if (cli.batch)
+        return packBatch(options, workers, cli, argv[argc - 2], argv[argc - 1]);
+
     auto timeBegin = std::chrono::steady_clock::now();
-    auto prevSymbolsToInflate = packer->symbolsToInflate;
-    result = packer->parsePsg(argv[argc-2]);
-    if (result == 0)
-        result = packer->packPsg(argv[argc - 1]);
+    PackSummary summary;
+    result = packInput(packer, options, workers, cli, argv[argc - 2], argv[argc - 1], summary, true);
     if (result != 0)
         return result;
 
-    while (packer->symbolsToInflate.size() != prevSymbolsToInflate.size())
-    {
-        prevSymbolsToInflate = packer->symbolsToInflate;
-        for (auto& s : prevSymbolsToInflate)
-            s.second = 0;
-
-        // Timings are fail. Pack again.
-        packer.reset(new PgsPacker());
-        parseArgs(argc, argv, packer.get());
-        packer->symbolsToInflate = prevSymbolsToInflate;
-
-        result = packer->parsePsg(argv[argc - 2]);
-        if (result == 0)
-            result = packer->packPsg(argv[argc - 1]);
-        if (result != 0)
-            return result;
-    }
-
-
-    if (packer->flags & dumpPsg)
-        packer->writeRawPsg(std::string(argv[argc - 1]) + ".psg");
-    if (packer->flags & dumpTimings)
-        packer->writeTimingsFile(std::string(argv[argc - 1]) + ".csv");
-
     auto timeEnd = steady_clock::now();
 
     std::cout << "Compression done in " << duration_cast<milliseconds>(timeEnd - timeBegin).count() / 1000.0 << " second(s)" << std::endl;
-    std::cout << "Input size:\t" << packer->srcPsgData.size() << std::endl;
+    std::cout << "Input size:\t" << summary.inputSize << std::endl;
     std::cout << "Packed size:\t" << packer->compressedData.size() << std::endl;
-    std::cout << "1-byte refs:\t" << packer->stats.singleRepeat << std::endl;
-    std::cout << "Total refs:\t" << packer->stats.allRepeat << std::endl;
-    std::cout << "Packed frames:\t" << packer->ayFrames.size() << std::endl;
-    std::cout << "Empty frames:\t" << packer->stats.emptyCnt << std::endl;
-    std::cout << "Frames in refs:\t" << packer->stats.allRepeatFrames << std::endl;
-    std::cout << "Total frames:\t" << packer->stats.outPsgFrames << std::endl;
-    if (packer->stats.level >= 4)
-        std::cout << "Nested level:\t" << packer->maxNestedLevel() << std::endl;
+    std::cout << "1-byte refs:\t" << summary.singleRepeat << std::endl;
+    std::cout << "Total refs:\t" << summary.allRepeat << std::endl;
+    std::cout << "Packed frames:\t" << summary.packedFrames << std::endl;
+    std::cout << "Empty frames:\t" << summary.emptyFrames << std::endl;
+    std::cout << "Frames in refs:\t" << summary.allRepeatFrames << std::endl;
+    std::cout << "Total frames:\t" << summary.totalFrames << std::endl;
+    if (summary.level >= 4)
+        std::cout << "Nested level:\t" << summary.nestedLevel << std::endl;
     
 
     int pos = 0;
@@ -1590,7 +1120,12 @@ int main(int argc, char** argv)
     }
 
     std::string comment;
-    std::cout << "The longest frame: " << t << "t" << comment << ", pos " << pos << ". Avarage frame: " << totalTicks / (packer->timingsData.size()) << "t" << std::endl;
+    if (!packer->timingsData.empty())
+        std::cout << "The longest frame: " << t << "t" << comment << ", pos " << pos << ". Avarage frame: " << totalTicks / (packer->timingsData.size()) << "t" << std::endl;
 
+    if (cli.profile)
+        printProfile(*packer, summary);
+    if (!cli.profileFileName.empty())
+        return writeProfileJson(cli.profileFileName, { profileJson(*packer, summary, argv[argc - 2]) });
     return 0;
 }
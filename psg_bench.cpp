@@ -0,0 +1,578 @@
+#include "psg_packer.h"
+#include "test_util.h"
+
+#include <sstream>
+#include <iomanip>
+#include <ctime>
+#include <cmath>
+#include <filesystem>
+
+/**
+ * Benchmarks of the packer stages: parsePsg, doCleanRegs, findRef, serializeFrame, the whole packPsg and packPsg with the lazy matching.
+ * Every stage runs on synthetic tracks and on the PSG files from the command line at every level.
+ * Results are written in the Google Benchmark JSON format, so the usual compare tools can read them.
+ */
+
+static const int kBenchLevels = 6;
+
+struct BenchInput
+{
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+struct BenchResult
+{
+    std::string name;
+    int64_t iterations = 0;
+    double realTime = 0; //< ns per iteration
+    double itemsPerSecond = 0;
+    double bytesPerSecond = 0;
+};
+
+/**
+ * Generate a PSG track of 'frames' frames. It is built from 32-frame patterns like a tracker song:
+ * notes with decaying volume, noise drums and rare envelope notes. 'repeatPercent' is the chance that
+ * the next pattern repeats one of the previous patterns.
+ */
+std::vector<uint8_t> makeSyntheticPsg(int frames, int repeatPercent, uint32_t seed)
+{
+    static const int kPatternSize = 32;
+    using Frame = std::vector<std::pair<uint8_t, uint8_t>>;
+
+    Random random(seed);
+    std::vector<std::vector<Frame>> patterns;
+
+    auto makePattern =
+        [&]()
+        {
+            std::vector<Frame> pattern(kPatternSize);
+            int volume[3] = {};
+            for (auto& frame : pattern)
+            {
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    if (random.next(8) == 0)
+                    {
+                        const int period = 64 + random.next(1024);
+                        frame.push_back({ uint8_t(channel * 2), uint8_t(period) });
+                        frame.push_back({ uint8_t(channel * 2 + 1), uint8_t(period >> 8) });
+                        volume[channel] = 15;
+                    }
+                    else if (volume[channel] > 0 && random.next(2) == 0)
+                    {
+                        --volume[channel];
+                    }
+                    frame.push_back({ uint8_t(8 + channel), uint8_t(volume[channel]) });
+                }
+                if (random.next(16) == 0)
+                {
+                    frame.push_back({ 6, uint8_t(random.next(32)) });
+                    frame.push_back({ 7, uint8_t(0x38 ^ (1 << (3 + random.next(3)))) });
+                }
+                if (random.next(64) == 0)
+                {
+                    frame.push_back({ 11, uint8_t(random.next(256)) });
+                    frame.push_back({ 12, 0 });
+                    frame.push_back({ 13, uint8_t(8 + random.next(8)) });
+                    frame.push_back({ 8, 16 });
+                }
+            }
+            return pattern;
+        };
+
+    std::vector<uint8_t> result = { 'P', 'S', 'G', 0x1a };
+    result.resize(16);
+    for (int frame = 0; frame < frames;)
+    {
+        if (patterns.empty() || random.next(100) >= repeatPercent)
+            patterns.push_back(makePattern());
+        const auto& pattern = patterns[random.next(patterns.size())];
+        for (int i = 0; i < kPatternSize && frame < frames; ++i, ++frame)
+        {
+            result.push_back(0xff);
+            for (const auto& reg : pattern[i])
+            {
+                result.push_back(reg.first);
+                result.push_back(reg.second);
+            }
+        }
+    }
+    result.push_back(0xfd);
+    return result;
+}
+
+class PackerBenchmark
+{
+public:
+    PackerBenchmark(double minTime, const std::string& filter) : m_minTime(minTime), m_filter(filter) {}
+
+    void run(const BenchInput& input)
+    {
+        benchCleanRegs(input);
+        for (int level = 0; level < kBenchLevels; ++level)
+        {
+            PackOptions options;
+            options.level = (CompressionLevel) level;
+            const std::string suffix = "/" + input.name + "/l" + std::to_string(level);
+
+            benchParse("parsePsg" + suffix, input, options);
+            benchFindRef("findRef" + suffix, input, options);
+            benchSerializeFrame("serializeFrame" + suffix, input, options);
+            benchPack("packPsg" + suffix, input, options);
+
+            PackOptions lazyOptions = options;
+            lazyOptions.lazySteps = kMaxLazySteps;
+            benchPack("packPsgLazy" + suffix, input, lazyOptions);
+        }
+    }
+
+    const std::vector<BenchResult>& results() const { return m_results; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static double elapsed(Clock::time_point from)
+    {
+        return std::chrono::duration<double, std::nano>(Clock::now() - from).count();
+    }
+
+    /**
+     * Repeat 'f' for m_minTime seconds at least. 'f' returns the time of the measured part in ns,
+     * so an iteration can prepare its data without affecting the result.
+     */
+    template <typename F>
+    void measure(const std::string& name, int64_t items, int64_t bytes, F&& f)
+    {
+        if (name.find(m_filter) == std::string::npos)
+            return;
+
+        BenchResult result;
+        result.name = name;
+        double total = 0;
+        const auto begin = Clock::now();
+        do
+        {
+            total += f();
+            ++result.iterations;
+        } while (total < m_minTime * 1e9 && elapsed(begin) < m_minTime * 1e9 * 10);
+
+        result.realTime = total / result.iterations;
+        if (total > 0)
+        {
+            result.itemsPerSecond = items * result.iterations * 1e9 / total;
+            result.bytesPerSecond = bytes * result.iterations * 1e9 / total;
+        }
+        std::cerr << std::left << std::setw(48) << name << std::right << std::setw(16) << std::fixed
+            << std::setprecision(0) << result.realTime << " ns" << std::setw(10) << result.iterations << std::endl;
+        m_results.push_back(result);
+    }
+
+    void prepare(const BenchInput& input, const PackOptions& options)
+    {
+        m_packer.reset();
+        m_packer.setOptions(options);
+        m_packer.parsePsg(input.data.data(), input.data.size());
+    }
+
+    void benchParse(const std::string& name, const BenchInput& input, const PackOptions& options)
+    {
+        prepare(input, options);
+        const int frames = m_packer.ayFrames.size();
+        measure(name, frames, input.data.size(),
+            [&]()
+            {
+                m_packer.reset();
+                m_packer.setOptions(options);
+                const auto begin = Clock::now();
+                m_packer.parsePsg(input.data.data(), input.data.size());
+                return elapsed(begin);
+            });
+    }
+
+    /** doCleanRegs doesn't depend on the level. It runs on the source regs of every frame. */
+    void benchCleanRegs(const BenchInput& input)
+    {
+        std::vector<RegVector> sourceRegs;
+        RegVector regs{};
+        PsgReader reader;
+        reader.open(input.data.data(), input.data.size());
+        PsgReader::Event event;
+        while (reader.next(event))
+        {
+            if (event.type == PsgReader::EventType::regWrite)
+                regs[event.reg] = event.value;
+            else
+                sourceRegs.push_back(regs);
+        }
+
+        measure("doCleanRegs/" + input.name, sourceRegs.size(), input.data.size(),
+            [&]()
+            {
+                m_packer.reset();
+                m_packer.setOptions(PackOptions());
+                const auto begin = Clock::now();
+                for (const auto& value : sourceRegs)
+                {
+                    m_packer.lastOrigRegs = value;
+                    m_packer.doCleanRegs();
+                }
+                return elapsed(begin);
+            });
+    }
+
+    /** The greedy pass of packPsg. Only findRef calls are measured. */
+    void benchFindRef(const std::string& name, const BenchInput& input, const PackOptions& options)
+    {
+        prepare(input, options);
+        const auto parsed = m_packer.parsed();
+        const int frames = m_packer.ayFrames.size();
+        measure(name, frames, 0,
+            [&]()
+            {
+                m_packer.reset();
+                m_packer.setOptions(options);
+                m_packer.loadParsed(parsed);
+                m_packer.restoreCheckpoint();
+                m_packer.compressedData.resize(kPsg2iSize * 2);
+
+                double total = 0;
+                auto& packer = m_packer;
+                for (int i = 0; i < packer.ayFrames.size();)
+                {
+                    while (packer.frameOffsets.size() <= i)
+                        packer.frameOffsets.push_back(packer.compressedData.size());
+
+                    if (packer.ayFrames.symbols[i] > kMaxDelay)
+                    {
+                        const auto begin = Clock::now();
+                        const auto [pos, len, reducedLen] = packer.findRef(i);
+                        total += elapsed(begin);
+                        if (len > 0)
+                        {
+                            packer.packRef(i, pos, len, reducedLen);
+                            i += len;
+                            continue;
+                        }
+                    }
+                    packer.packFrame(i);
+                    ++i;
+                }
+                return total;
+            });
+    }
+
+    /** Serialize every frame as is. */
+    void benchSerializeFrame(const std::string& name, const BenchInput& input, const PackOptions& options)
+    {
+        prepare(input, options);
+        std::vector<uint16_t> positions;
+        for (int i = 0; i < m_packer.ayFrames.size(); ++i)
+        {
+            if (m_packer.ayFrames.symbols[i] > kMaxDelay)
+                positions.push_back(i);
+        }
+        measure(name, positions.size(), 0,
+            [&]()
+            {
+                m_packer.compressedData.clear();
+                m_packer.timingsData.clear();
+                const auto begin = Clock::now();
+                for (uint16_t pos : positions)
+                    m_packer.serializeFrame(pos);
+                return elapsed(begin);
+            });
+    }
+
+    /** packPsg including the repack passes after inflateSymbols and optimizeMaskIndex, parse result is reused. */
+    void benchPack(const std::string& name, const BenchInput& input, const PackOptions& options)
+    {
+        prepare(input, options);
+        const auto parsed = m_packer.parsed();
+        const int frames = m_packer.ayFrames.size();
+        measure(name, frames, input.data.size(),
+            [&]()
+            {
+                m_packer.reset();
+                m_packer.setOptions(options);
+                m_packer.loadParsed(parsed);
+                const auto begin = Clock::now();
+                int result = m_packer.packPsg();
+                while (result == 0 && m_packer.inflateSymbols())
+                    result = m_packer.packPsg();
+                if (result == 0)
+                    m_packer.optimizeMaskIndex();
+                return elapsed(begin);
+            });
+    }
+
+    double m_minTime = 0;
+    std::string m_filter;
+    PgsPacker m_packer;
+    std::vector<BenchResult> m_results;
+};
+
+std::string jsonString(const std::string& value)
+{
+    std::string result = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        result += c;
+    }
+    return result + "\"";
+}
+
+void writeJson(std::ostream& out, const std::vector<BenchResult>& results, const std::string& executable)
+{
+    char date[32] = {};
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+    out << "{" << std::endl;
+    out << "  \"context\": {" << std::endl;
+    out << "    \"date\": " << jsonString(date) << "," << std::endl;
+    out << "    \"executable\": " << jsonString(executable) << "," << std::endl;
+    out << "    \"num_cpus\": " << std::thread::hardware_concurrency() << "," << std::endl;
+    out << "    \"packer_version\": " << jsonString(kPackerVersion) << "," << std::endl;
+#ifdef NDEBUG
+    out << "    \"library_build_type\": \"release\"" << std::endl;
+#else
+    out << "    \"library_build_type\": \"debug\"" << std::endl;
+#endif
+    out << "  }," << std::endl;
+    out << "  \"benchmarks\": [" << std::endl;
+    for (int i = 0; i < results.size(); ++i)
+    {
+        const auto& result = results[i];
+        out << "    {" << std::endl;
+        out << "      \"name\": " << jsonString(result.name) << "," << std::endl;
+        out << "      \"run_name\": " << jsonString(result.name) << "," << std::endl;
+        out << "      \"run_type\": \"iteration\"," << std::endl;
+        out << "      \"iterations\": " << result.iterations << "," << std::endl;
+        out << std::fixed << std::setprecision(3);
+        out << "      \"real_time\": " << result.realTime << "," << std::endl;
+        out << "      \"cpu_time\": " << result.realTime << "," << std::endl;
+        out << "      \"time_unit\": \"ns\"," << std::endl;
+        if (result.bytesPerSecond > 0)
+            out << "      \"bytes_per_second\": " << result.bytesPerSecond << "," << std::endl;
+        out << "      \"items_per_second\": " << result.itemsPerSecond << std::endl;
+        out << "    }" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+/**
+ * Write the PGO training corpus: synthetic tracks of several lengths and repetitiveness.
+ * Tracks are generated from fixed seeds, so every build trains on the same data.
+ */
+int writeCorpus(const std::string& dir)
+{
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    for (int frames : { 1500, 4000, 12000 })
+    {
+        for (int repeatPercent : { 20, 60, 90 })
+        {
+            const auto data = makeSyntheticPsg(frames, repeatPercent, frames * 100 + repeatPercent);
+            const auto fileName = (std::filesystem::path(dir)
+                / ("train_" + std::to_string(frames) + "_rep" + std::to_string(repeatPercent) + ".psg")).string();
+            std::ofstream fileOut(fileName, std::ios::binary | std::ios::trunc);
+            if (!fileOut.is_open())
+            {
+                std::cerr << "Can't open output file " << fileName << std::endl;
+                return -1;
+            }
+            fileOut.write((const char*) data.data(), data.size());
+        }
+    }
+    return 0;
+}
+
+/** Read names and times from a JSON file written by writeJson. */
+int readJson(const std::string& fileName, std::vector<std::pair<std::string, double>>& results)
+{
+    std::ifstream fileIn(fileName);
+    if (!fileIn.is_open())
+    {
+        std::cerr << "Can't open input file " << fileName << std::endl;
+        return -1;
+    }
+
+    auto value =
+        [](const std::string& line)
+        {
+            const auto pos = line.find(':');
+            auto result = line.substr(pos + 1);
+            result.erase(0, result.find_first_not_of(" \""));
+            result.erase(result.find_last_not_of(" \",") + 1);
+            return result;
+        };
+
+    std::string line;
+    std::string name;
+    while (std::getline(fileIn, line))
+    {
+        if (line.find("\"name\":") != std::string::npos)
+            name = value(line);
+        else if (line.find("\"real_time\":") != std::string::npos && !name.empty())
+            results.push_back({ name, atof(value(line).c_str()) });
+    }
+    return 0;
+}
+
+/** Print the speed up of every benchmark from 'newFileName' against 'baseFileName'. */
+int compareJson(const std::string& baseFileName, const std::string& newFileName)
+{
+    std::vector<std::pair<std::string, double>> baseResults, newResults;
+    if (readJson(baseFileName, baseResults) != 0 || readJson(newFileName, newResults) != 0)
+        return -1;
+
+    std::map<std::string, double> baseTimes(baseResults.begin(), baseResults.end());
+    std::map<std::string, std::pair<double, int>> stages; //< stage -> sum of log(speed up), count
+    double logSum = 0;
+    int count = 0;
+
+    std::cout << std::left << std::setw(48) << "Benchmark" << std::right << std::setw(16) << "Base, ns"
+        << std::setw(16) << "New, ns" << std::setw(10) << "Speed up" << std::endl;
+    for (const auto& result : newResults)
+    {
+        auto itr = baseTimes.find(result.first);
+        if (itr == baseTimes.end() || itr->second <= 0 || result.second <= 0)
+            continue;
+        const double speedUp = itr->second / result.second;
+        std::cout << std::left << std::setw(48) << result.first << std::right << std::fixed << std::setprecision(0)
+            << std::setw(16) << itr->second << std::setw(16) << result.second
+            << std::setw(9) << std::setprecision(2) << speedUp << "x" << std::endl;
+
+        auto& stage = stages[result.first.substr(0, result.first.find('/'))];
+        stage.first += std::log(speedUp);
+        ++stage.second;
+        logSum += std::log(speedUp);
+        ++count;
+    }
+    if (count == 0)
+    {
+        std::cerr << "No common benchmarks in " << baseFileName << " and " << newFileName << std::endl;
+        return -1;
+    }
+
+    std::cout << "Geometric mean speed up:" << std::endl;
+    for (const auto& stage : stages)
+    {
+        std::cout << "  " << std::left << std::setw(16) << stage.first << std::right << std::setprecision(2)
+            << std::exp(stage.second.first / stage.second.second) << "x" << std::endl;
+    }
+    std::cout << "  " << std::left << std::setw(16) << "total" << std::right << std::exp(logSum / count) << "x" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    double minTime = 0.1;
+    std::string filter;
+    std::string outputFileName;
+    std::vector<std::string> inputFiles;
+    bool synthetic = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string s = argv[i];
+        if (((s == "--min-time" || s == "--filter" || s == "--out" || s == "--write-corpus") && i == argc - 1)
+            || (s == "--compare" && i >= argc - 2))
+        {
+            std::cerr << "It need to define a value after the argument '" << s << "'" << std::endl;
+            return -1;
+        }
+        if (s == "--min-time")
+            minTime = atof(argv[++i]);
+        else if (s == "--filter")
+            filter = argv[++i];
+        else if (s == "--out")
+            outputFileName = argv[++i];
+        else if (s == "--no-synthetic")
+            synthetic = false;
+        else if (s == "--write-corpus")
+            return writeCorpus(argv[i + 1]);
+        else if (s == "--compare")
+            return compareJson(argv[i + 1], argv[i + 2]);
+        else if (s == "-h" || s == "--help")
+        {
+            std::cout << "Usage: psg_bench [OPTION] [file.psg|dir ...]" << std::endl;
+            std::cout << "Times the packer stages on synthetic tracks and the given PSG files at every level." << std::endl;
+            std::cout << "All *.psg files are taken from the directory inputs." << std::endl;
+            std::cout << "--min-time <S>\t Run every benchmark S seconds at least. Default is 0.1." << std::endl;
+            std::cout << "--filter <text>\t Run benchmarks with the text in the name only. Example: --filter findRef/" << std::endl;
+            std::cout << "--out <file>\t Write JSON results to the file instead of stdout." << std::endl;
+            std::cout << "--compare <base.json> <new.json>\t Print the speed up of every benchmark in new.json against base.json." << std::endl;
+            std::cout << "--no-synthetic\t Use the given PSG files only." << std::endl;
+            std::cout << "--write-corpus <dir>\t Write the synthetic PGO training tracks into the directory." << std::endl;
+            return 0;
+        }
+        else
+            inputFiles.push_back(s);
+    }
+
+    std::vector<BenchInput> inputs;
+    for (int frames : { 2000, 20000 })
+    {
+        if (!synthetic)
+            break;
+        for (int repeatPercent : { 0, 50, 90 })
+        {
+            const std::string name = "synthetic_" + std::to_string(frames) + "_rep" + std::to_string(repeatPercent);
+            inputs.push_back({ name, makeSyntheticPsg(frames, repeatPercent, frames + repeatPercent) });
+        }
+    }
+    std::vector<std::string> fileNames;
+    for (const auto& inputFile : inputFiles)
+    {
+        std::error_code error;
+        if (!std::filesystem::is_directory(inputFile, error))
+        {
+            fileNames.push_back(inputFile);
+            continue;
+        }
+        std::vector<std::string> dirFiles;
+        for (const auto& entry : std::filesystem::directory_iterator(inputFile, error))
+        {
+            if (entry.is_regular_file(error) && entry.path().extension() == ".psg")
+                dirFiles.push_back(entry.path().string());
+        }
+        std::sort(dirFiles.begin(), dirFiles.end());
+        fileNames.insert(fileNames.end(), dirFiles.begin(), dirFiles.end());
+    }
+
+    for (const auto& fileName : fileNames)
+    {
+        std::ifstream fileIn(fileName, std::ios::binary);
+        if (!fileIn.is_open())
+        {
+            std::cerr << "Can't open input file " << fileName << std::endl;
+            return -1;
+        }
+        BenchInput input;
+        input.name = fileName.substr(fileName.find_last_of("/\\") + 1);
+        input.data.assign(std::istreambuf_iterator<char>(fileIn), std::istreambuf_iterator<char>());
+        inputs.push_back(std::move(input));
+    }
+
+    PackerBenchmark benchmark(minTime, filter);
+    for (const auto& input : inputs)
+        benchmark.run(input);
+
+    if (outputFileName.empty())
+    {
+        writeJson(std::cout, benchmark.results(), argv[0]);
+        return 0;
+    }
+    std::ofstream fileOut(outputFileName, std::ios::trunc);
+    if (!fileOut.is_open())
+    {
+        std::cerr << "Can't open output file " << outputFileName << std::endl;
+        return -1;
+    }
+    writeJson(fileOut, benchmark.results(), argv[0]);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#include "psg_packer.h"
+
+std::vector<uint8_t> pack(const uint8_t* psg, size_t size, const PackOptions& options)
+{
+    PgsPacker packer;
+    return packer.pack(psg, size, options);
+}
+
+std::vector<uint8_t> pack(const std::vector<uint8_t>& psg, const PackOptions& options)
+{
+    return pack(psg.data(), psg.size(), options);
+}
@@ -0,0 +1,3062 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <set>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <array>
+#include <limits>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PSG_PACK_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PSG_PACK_NEON
+#endif
+
+// Hot path counters for --profile. Build with PSG_PACK_PROFILE to compile them in.
+#ifdef PSG_PACK_PROFILE
+#define PSG_PROFILE(...) __VA_ARGS__
+#else
+#define PSG_PROFILE(...)
+#endif
+
+static const char* const kPackerVersion = "0.9b";
+// Version of the packing algorithm. Bump it with any change that changes the packed output for the same input
+// and options: the packed files cache keys on it.
+static const int kPackAlgorithmVersion = 3;
+static const uint8_t kEndTrackMarker = 0x0f;
+static const int kMaxDelay = 256;
+static const int kMaxRefOffset = 16384;
+static const int kPsg2iSize = 32;
+static const int kMaxMaskIndexPasses = 4; //< Repacks by optimizeMaskIndex with the repackMaskIndex flag
+
+static const int kMaxTimeForL4 = 930;
+
+static const int kMinParallelCandidates = 16;
+static const int kOptimalBlockSize = 512;
+static const int kMaxLazySteps = 2;
+static const int kPackCheckpointInterval = 4096;
+static const int kMaxPackCheckpoints = 16;
+static const int kReadChunkSize = 64 * 1024;
+
+enum Flags
+{
+    none = 0,
+    
+    cleanRegs  = 2,
+    cleanToneA = 4,
+    cleanToneB = 8,
+    cleanToneC = 16,
+    cleanEnvelope = 32,
+    cleanEnvForm = 64,
+    cleanNoise = 128,
+    
+    dumpPsg = 256,
+    dumpTimings = 512,
+    addScf = 1024,
+    optimalParse = 2048,
+    repackMaskIndex = 4096
+};
+
+enum class TimingState
+{
+    single,
+    longFirst,
+    first,
+    mid,
+    last
+};
+
+enum CompressionLevel
+{
+    l0,   //< Maximum speed. Max frame time=802t.
+    l1,   //< Same max frame time, avarage frame size worse a little bit, better compression.
+    l2,   //< Max frame time about 828t, better compression.
+    l3,   //< Max frame time above 900t, better compression.
+    l4,   //< Allow recursive refs. It requires slow_psg_player.asm
+};
+
+static const int kDefaultFlags = cleanNoise - 1;
+static const int kCleanFlags = cleanRegs | cleanToneA | cleanToneB | cleanToneC | cleanEnvelope | cleanEnvForm | cleanNoise;
+
+static const int kRegCount = 14;
+static const uint16_t kReg13Bit = 1 << 13;
+
+using RegState = std::array<uint8_t, 16>; //< Reg values padded to a SIMD register. Bytes 14, 15 are zero.
+
+/**
+ * Flat reg -> value map for the 14 AY registers: a presence bit per reg plus the values.
+ * Values of absent regs are kept zero, so equality, ordering and hashing can work on raw fields.
+ */
+struct RegMap
+{
+    uint16_t mask = 0;
+    RegState values{};
+
+    bool has(int reg) const { return mask & (1 << reg); }
+    int operator[](int reg) const { return values[reg]; }
+    int size() const { return popCount(mask); }
+    bool empty() const { return mask == 0; }
+
+    void set(int reg, int value)
+    {
+        mask |= 1 << reg;
+        values[reg] = value;
+    }
+
+    void clear()
+    {
+        mask = 0;
+        values.fill(0);
+    }
+
+    bool operator==(const RegMap& other) const { return mask == other.mask && values == other.values; }
+    bool operator!=(const RegMap& other) const { return !(*this == other); }
+    bool operator<(const RegMap& other) const
+    {
+        if (mask != other.mask)
+            return mask < other.mask;
+        return values < other.values;
+    }
+
+    static int popCount(uint16_t value)
+    {
+        int result = 0;
+        for (; value; value &= value - 1)
+            ++result;
+        return result;
+    }
+};
+
+struct RegMapHash
+{
+    size_t operator()(const RegMap& regs) const
+    {
+        // FNV-1a over the mask and the values.
+        uint64_t result = 14695981039346656037ull;
+        auto add = [&](uint8_t value)
+        {
+            result ^= value;
+            result *= 1099511628211ull;
+        };
+        add(regs.mask & 0xff);
+        add(regs.mask >> 8);
+        for (int i = 0; i < kRegCount; ++i)
+            add(regs.values[i]);
+        return result;
+    }
+};
+
+using RegVector = std::array<int, 14>;
+
+inline RegState packRegs(const RegVector& regs)
+{
+    RegState result{};
+    for (int i = 0; i < kRegCount; ++i)
+        result[i] = regs[i];
+    return result;
+}
+
+/** Bit i of the result is set if a[i] == b[i]. */
+inline uint16_t equalBytesMaskScalar(const uint8_t* a, const uint8_t* b)
+{
+    uint16_t result = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        if (a[i] == b[i])
+            result |= 1 << i;
+    }
+    return result;
+}
+
+inline uint16_t equalBytesMask(const uint8_t* a, const uint8_t* b)
+{
+#if defined(PSG_PACK_SSE2)
+    const __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) a), _mm_loadu_si128((const __m128i*) b));
+    return (uint16_t) _mm_movemask_epi8(eq);
+#elif defined(PSG_PACK_NEON)
+    static const uint8_t kBits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t bits = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), vld1q_u8(kBits));
+    uint8x8_t low = vget_low_u8(bits);
+    uint8x8_t high = vget_high_u8(bits);
+    for (int i = 0; i < 3; ++i)
+    {
+        low = vpadd_u8(low, low);
+        high = vpadd_u8(high, high);
+    }
+    return vget_lane_u8(low, 0) | (vget_lane_u8(high, 0) << 8);
+#else
+    return equalBytesMaskScalar(a, b);
+#endif
+}
+
+/**
+ * Master regs cover the slave frame if they are a superset of the slave delta and all of them
+ * match the slave full state. Master reg13 (envelope retrig) requires reg13 in the slave delta.
+ */
+inline bool isRegsCover(uint16_t masterMask, const RegState& masterValues, uint16_t slaveMask, const RegState& slaveState)
+{
+    if ((masterMask & slaveMask) != slaveMask)
+        return false;
+    if ((masterMask & kReg13Bit) && !(slaveMask & kReg13Bit))
+        return false;
+    const uint16_t equal = equalBytesMask(masterValues.data(), slaveState.data());
+    assert(equal == equalBytesMaskScalar(masterValues.data(), slaveState.data()));
+    return (equal & masterMask) == masterMask;
+}
+
+inline auto splitRegs(const RegMap& regs)
+{
+    int firstRegs = RegMap::popCount(regs.mask & 0x3f);
+    int secondRegs = regs.size() - firstRegs;
+    return std::tuple<int, int>(firstRegs, secondRegs);
+}
+
+inline uint8_t reverseBits(uint8_t value)
+{
+    uint8_t b = value;
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+inline uint8_t makeRegMask(const RegMap& regs, int from, int to)
+{
+    uint8_t result = 0;
+    uint8_t bit = 0x80;
+    for (int i = from; i < to; ++i)
+    {
+        if (!regs.has(i))
+            result += bit;
+        bit >>= 1;
+    }
+    return result;
+}
+
+inline uint16_t longRegMask(const RegMap& regs)
+{
+    uint8_t mask1 = makeRegMask(regs, 0, 6);
+    uint8_t mask2 = makeRegMask(regs, 6, 14);
+
+    mask1 = reverseBits(mask1) << 2;
+    mask2 = reverseBits(mask2);
+
+    return mask1 + mask2 * 256;
+}
+
+struct Stats
+{
+    int outPsgFrames = 0;
+    int inPsgFrames = 0;
+
+    int emptyCnt = 0;
+    int emptyFrames = 0;
+
+    int singleRepeat = 0;
+    int allRepeat = 0;
+    int allRepeatFrames = 0;
+
+    int ownCnt = 0;
+    int ownBytes = 0;
+
+    std::map<int, int> frameRegs;
+    std::map<int, int> regsChange;
+
+    std::map<int, int> firstHalfRegs;
+    std::map<int, int> secondHalfRegs;
+
+    int unusedToneA = 0;
+    int unusedToneB = 0;
+    int unusedToneC = 0;
+    int unusedEnvelope = 0;
+    int unusedEnvForm = 0;
+    int unusedNoise = 0;
+    bool addScf = false;
+
+    std::map<int, int> maskToUsage;
+    std::multimap<int, int> usageToMask;
+    std::map<int, int> maskIndex;
+    CompressionLevel level = CompressionLevel::l1;
+};
+
+/**
+ * Packer counters and timers. Counters are atomic because findRef evaluates candidates in several threads.
+ * Hot loops count in local variables and add the sums once per call.
+ */
+struct Profile
+{
+    enum Counter
+    {
+        parseTime,        //< ns
+        packTime,         //< ns
+        packPasses,       //< packPsg calls, the first one and the repacks after inflateSymbols and optimizeMaskIndex
+        findRefCalls,
+        refCandidates,    //< Candidates examined by findRef
+        frameCoverCalls,  //< isFrameCover checks, frameCoverMask counts each master
+        frameCoverHits,
+        chainSteps,       //< Frames added to ref chains
+        optimalBlocks,    //< parseBlock calls
+        optimalRestarts,  //< Optimal parse restarts when a ref source isn't serialized as is
+        counterCount
+    };
+
+    std::array<std::atomic<uint64_t>, counterCount> values;
+
+    Profile() { clear(); }
+
+    static const char* name(int counter)
+    {
+        static const char* const kNames[counterCount] = { "parseTime", "packTime", "packPasses", "findRefCalls",
+            "refCandidates", "frameCoverCalls", "frameCoverHits", "chainSteps", "optimalBlocks", "optimalRestarts" };
+        return kNames[counter];
+    }
+
+    void add(Counter counter, uint64_t value) { values[counter].fetch_add(value, std::memory_order_relaxed); }
+    uint64_t operator[](int counter) const { return values[counter].load(std::memory_order_relaxed); }
+
+    void clear()
+    {
+        for (auto& value : values)
+            value.store(0, std::memory_order_relaxed);
+    }
+
+    void merge(const Profile& other)
+    {
+        for (int i = 0; i < counterCount; ++i)
+            add((Counter) i, other[i]);
+    }
+
+    static uint64_t nanoseconds(std::chrono::steady_clock::time_point from)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - from).count();
+    }
+};
+
+inline bool isPsg2(const RegMap& regs, uint16_t symbol, const Stats& stats)
+{
+    return regs.size() > 1;
+}
+
+struct RefInfo
+{
+    int refTo = -1;
+    int reducedLen = 0;
+    int refLen = 0;
+    int level = 0;
+    int offsetInRef = 0;
+};
+
+class TimingsHelper
+{
+private:
+    const Stats& m_stats;
+    const std::vector<RefInfo>& m_refInfo;
+    std::vector<int> m_pl0xTimings; //< symbol -> pl0x time. Built by updateSymbolTimings.
+public:
+    TimingsHelper(const Stats& stats, const std::vector<RefInfo>& refInfo):
+        m_stats(stats),
+        m_refInfo(refInfo)
+    {
+    }
+
+    /**
+     * pl0x time depends on the symbol regs, 'addScf' and the PSG2i mask index only. Build the table
+     * when the mask index is changed, the hot paths look it up instead of computing it again.
+     */
+    void updateSymbolTimings(const std::vector<RegMap>& symbolToRegs)
+    {
+        m_pl0xTimings.assign(symbolToRegs.size(), 0);
+        for (int symbol = kMaxDelay + 1; symbol < symbolToRegs.size(); ++symbol)
+            m_pl0xTimings[symbol] = calcPl0xTimings(symbolToRegs[symbol], symbol);
+    }
+
+    /** Drop the table, pl0x time is computed at each call till the next updateSymbolTimings. */
+    void clearSymbolTimings() { m_pl0xTimings.clear(); }
+
+    int trbRepTimings(int trdRep)
+    {
+        if (m_stats.level < 4)
+        {
+            if (trdRep == 0)
+                return 7 + 4 + 11;
+            int result = 7 + 4 + 5;
+            if (trdRep > 1)
+            {
+                result += 13 + 11;
+                return result;
+            }
+
+            result += 13 + 5 + 42;
+            return result;
+        }
+        else
+        {
+            if (trdRep != 1)
+                return 4 + 11 + 11;
+            return 20+34;
+        }
+    }
+
+    int frameTimings(const RegMap& regs, int trbRep, uint16_t symbol)
+    {
+        int result = 0;
+        if (m_stats.level < 4)
+            result += 28 + 17;  //< before pl_frame
+        else
+            result += 34+5 +17;  //< before pl_frame
+        result += pl0xTimings(regs, symbol);
+        if (m_stats.level < 4)
+            result += 16;
+        else
+            result += 59;
+
+        return result + trbRepTimings(trbRep);
+    }
+
+    int pause_cont()
+    {
+        if (m_stats.level < 4)
+            return 13 + 16 + 4 + 13 + 10 + 16 + 10 + 10;
+        return 114;
+    }
+
+    int after_play_frame(int trbRep)
+    {
+        int result = 0;
+        if (m_stats.level < 4)
+            result += 16;
+        else
+            result += 59;
+        return result + trbRepTimings(trbRep);
+    }
+
+    int delayTimings(TimingState state, int trbRep)
+    {
+        int pl_pause = m_stats.level < 4 ? 98 : 109;
+        int result = 0;
+        switch (state)
+        {
+            case TimingState::single:
+                result = pl_pause + 12 + 7 + 6 + 12 + 10 + 10;
+                result += after_play_frame(trbRep);
+                break;
+            case TimingState::longFirst:
+                result = pl_pause + 7 + 12 + 6 + 7 + 6 + 12 + pause_cont();
+                break;
+            case TimingState::first:
+                result = pl_pause + 12 + 7 + 6 + 7 + pause_cont();
+                break;
+            case TimingState::mid:
+                result = 12 + 10 + 11 + 11;
+                break;
+            case TimingState::last:
+                result = 12 + 26 + 38;
+                if (m_stats.level >= 4)
+                    result += 16;
+                result += trbRepTimings(trbRep);
+                break;
+        }
+        return result;
+    }
+
+    static int play_all_6_13(const RegMap& regs)
+    {
+        int result = 341;
+        if (!regs.has(13))
+            result -= 35;
+        return result;
+    }
+
+    int play_by_mask_13_6(const RegMap& regs)
+    {
+        int result = 53;
+        if (!regs.has(13))
+            result -= 34;
+        for (int i = 12; i > 6; --i)
+        {
+            result += 54;
+            if (!regs.has(i))
+                result -= 34;
+        }
+
+        if (!regs.has(6))
+        {
+            result += 4 + 11;
+            if (m_stats.addScf)
+                result -= 4; //< Early 'ret c' here. There is no 'scf' overhead.
+        }
+        else
+        {
+            result += 55;
+        }
+
+        return result;
+    }
+
+    int reg_left_6(const RegMap& regs)
+    {
+        int result = 0;
+
+        if (regs.has(5))
+            result += 4 + 7 + 12 + 4 + 16 + 7;
+        else
+            result += 4+12;
+
+        for (int i = 4; i > 0; --i)
+        {
+            if (regs.has(i))
+                result += 54;
+            else
+                result += 20;
+        }
+
+        if (!regs.has(0))
+        {
+            result += 4 + 11;
+        }
+        else
+        {
+            if (m_stats.addScf)
+                result += 4; //< Extra 'scf' here.
+            result += 55;
+        }
+
+        return result;
+    }
+
+    int play_all_0_5_end(const RegMap& regs)
+    {
+        const auto [firstRegs, secondRegs] = splitRegs(regs);
+        int secondRegsExcept13 = secondRegs;
+        if (regs.has(13))
+            --secondRegsExcept13;
+
+        int result = 24;
+
+        if (secondRegsExcept13 == 7)
+            result += play_all_6_13(regs);
+        else
+            result += 5 + play_by_mask_13_6(regs);
+
+        return result;
+    }
+
+    int pl00TimeForFrame(const RegMap& regs, uint16_t symbol)
+    {
+        if (regs.size() == 1)
+            return 4 + 12 + 4 + 7 + 7 + 7+7+7+4+6+45;
+
+        return 29+53+17 + reg_left_6(regs) + 36 + play_by_mask_13_6(regs);
+    }
+
+    int pl0xTimings(const RegMap& regs, uint16_t symbol)
+    {
+        if (symbol < m_pl0xTimings.size())
+        {
+            assert(m_pl0xTimings[symbol] == calcPl0xTimings(regs, symbol));
+            return m_pl0xTimings[symbol];
+        }
+        return calcPl0xTimings(regs, symbol);
+    }
+
+    int calcPl0xTimings(const RegMap& regs, uint16_t symbol)
+    {
+        const auto [firstRegs, secondRegs] = splitRegs(regs);
+        int secondRegsExcept13 = secondRegs;
+        if (regs.has(13))
+            --secondRegsExcept13;
+
+        uint16_t longMask = longRegMask(regs);
+        bool psg2 = isPsg2(regs, symbol, m_stats);
+        if (!psg2 || m_stats.maskIndex.count(longMask))
+            return 21 + 5 + pl00TimeForFrame(regs, symbol);
+
+        // PSG2 timings
+        int result = 44; //< Till jump to play_all_0_5
+
+        if (firstRegs < 6)
+        {
+            // play_by_mask_0_5
+            for (int i = 0; i < 5; ++i)
+            {
+                if (!regs.has(i))
+                    result += 20; //< There is no reg i.
+                else
+                    result += 54;
+            }
+
+            if (!regs.has(5))
+            {
+                result += 4 + 12; // 'play_all_0_5_end' reached
+                result += play_all_0_5_end(regs);
+            }
+            else
+            {
+                result += 43 + 24;
+                if (secondRegsExcept13 == 7)
+                    result += 5 + play_all_6_13(regs);
+                else
+                    result += 7 + 10 + play_by_mask_13_6(regs);
+            }
+        }
+        else
+        {
+            result += 5;
+            result += 240;
+            result += play_all_0_5_end(regs);
+        }
+
+        return result;
+    }
+
+    int shortRefTimings(const RegMap& regs, uint16_t symbol, int trbRep)
+    {
+        int result = m_stats.level >= 4 ? 185 : 115;
+        result += TimingsHelper::pl0xTimings(regs, symbol);
+        if (m_stats.level >= 4)
+            result += trbRepTimings(trbRep);
+        return result;
+    }
+
+    int longRefInitTiming(int pos, const RegMap& regs, uint16_t symbol, int symbolsLeftAtLevel)
+    {
+        int result = m_stats.level >= 4 ? 269 : 170;
+
+        if (m_stats.level >= 4 && symbolsLeftAtLevel == 1)
+        {
+            // same level ref
+            result -= 26 - 5;
+        }
+
+        result += TimingsHelper::pl0xTimings(regs, symbol);
+        return result;
+    }
+};
+
+struct CutRange
+{
+    int from = -1;
+    int to = -1;
+
+    bool isEmpty() const { return from == -1 && to == -1; }
+};
+
+/**
+ * Packer options. They match the command line options.
+ */
+struct PackOptions
+{
+    CompressionLevel level = l1;
+    int flags = kDefaultFlags;
+    int threads = 1;
+    int timeLimit = 0; //< Max frame time in t-states. Zero means the time is defined by the compression level only.
+    int lazySteps = 0; //< Greedy parse lookahead in frames, up to kMaxLazySteps.
+    std::vector<CutRange> cutRanges;
+};
+
+/**
+ * Read only memory mapped file. Only non empty regular files can be mapped.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& fileName)
+    {
+        close();
+        return map(fileName);
+    }
+
+    void close()
+    {
+        if (m_view)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(m_view);
+#else
+            munmap(m_view, m_size);
+#endif
+            m_view = nullptr;
+        }
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    bool map(const std::string& fileName)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (!mapping)
+            return false;
+        m_view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping); //< The view keeps the mapping alive.
+        if (!m_view)
+            return false;
+        m_size = fileSize.QuadPart;
+#else
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* view = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); //< The mapping stays valid after close.
+        if (view == MAP_FAILED)
+            return false;
+        madvise(view, st.st_size, MADV_SEQUENTIAL);
+        m_view = view;
+        m_size = st.st_size;
+#endif
+        m_data = (const uint8_t*) m_view;
+        return true;
+    }
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    void* m_view = nullptr;
+};
+
+/**
+ * PSG tokenizer. Regular files are memory mapped. Other inputs (stdin, pipes) are read by chunks,
+ * so the memory doesn't depend on the input size. Use "-" as file name to read stdin.
+ */
+class PsgReader
+{
+public:
+    enum class EventType
+    {
+        regWrite,   //< Set 'reg' to 'value'.
+        frameEnd,   //< 0xff
+        delay,      //< 0xfe. 'value' is the delay in frames.
+    };
+
+    struct Event
+    {
+        EventType type = EventType::frameEnd;
+        int reg = 0;
+        int value = 0;
+    };
+
+    PsgReader() = default;
+    PsgReader(const PsgReader&) = delete;
+    PsgReader& operator=(const PsgReader&) = delete;
+    ~PsgReader()
+    {
+        if (m_file && m_file != stdin)
+            fclose(m_file);
+    }
+
+    /** Read PSG from memory. The data should stay alive while the reader is used. */
+    void open(const uint8_t* data, size_t size)
+    {
+        m_pos = data;
+        m_end = data + size;
+        m_bytesRead = size;
+        readHeader();
+    }
+
+    bool open(const std::string& fileName)
+    {
+        if (fileName == "-")
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            m_file = stdin;
+        }
+        else if (m_mappedFile.open(fileName))
+        {
+            m_pos = m_mappedFile.data();
+            m_end = m_pos + m_mappedFile.size();
+            m_bytesRead = m_mappedFile.size();
+        }
+        else
+        {
+            m_file = fopen(fileName.c_str(), "rb");
+            if (!m_file)
+                return false;
+        }
+
+        readHeader();
+        return true;
+    }
+
+    /**
+     * Read the next event. Return false at the end of the track or the end of the input.
+     * Truncated trailing commands are ignored.
+     */
+    bool next(Event& event)
+    {
+        if (!fill(1))
+            return false;
+
+        const uint8_t value = *m_pos;
+        if (value == 0xff)
+        {
+            event.type = EventType::frameEnd;
+            ++m_pos;
+            return true;
+        }
+        if (value == 0xfd)
+            return false;
+
+        if (!fill(2))
+            return false;
+        if (value == 0xfe)
+        {
+            event.type = EventType::delay;
+            event.value = m_pos[1] * 4;
+        }
+        else
+        {
+            event.type = EventType::regWrite;
+            event.reg = value;
+            event.value = m_pos[1];
+        }
+        m_pos += 2;
+        return true;
+    }
+
+    const std::array<uint8_t, 16>& header() const { return m_header; }
+    size_t bytesRead() const { return m_bytesRead; }
+
+private:
+    void readHeader()
+    {
+        fill(m_header.size());
+        const int headerSize = std::min<size_t>(m_end - m_pos, m_header.size());
+        std::copy_n(m_pos, headerSize, m_header.begin());
+        m_pos += headerSize;
+    }
+
+    /**
+     * Make sure at least 'size' bytes are available. The rest of the current chunk is moved
+     * to the buffer start, so commands split between chunks are read as a whole.
+     */
+    bool fill(size_t size)
+    {
+        const size_t left = m_end - m_pos;
+        if (left >= size)
+            return true;
+        if (!m_file)
+            return false;
+
+        if (m_buffer.empty())
+            m_buffer.resize(kReadChunkSize);
+        if (left > 0)
+            memmove(m_buffer.data(), m_pos, left);
+        const size_t bytes = fread(m_buffer.data() + left, 1, m_buffer.size() - left, m_file);
+        m_bytesRead += bytes;
+        m_pos = m_buffer.data();
+        m_end = m_pos + left + bytes;
+        return left + bytes >= size;
+    }
+
+    MappedFile m_mappedFile;
+    std::FILE* m_file = nullptr;
+    std::vector<uint8_t> m_buffer;
+    const uint8_t* m_pos = nullptr;
+    const uint8_t* m_end = nullptr;
+    size_t m_bytesRead = 0;
+    std::array<uint8_t, 16> m_header{};
+};
+
+/**
+ * Minimal fixed size thread pool. The calling thread works as thread 0.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool(int threads)
+    {
+        for (int i = 1; i < threads; ++i)
+            m_threads.emplace_back([this, i]() { worker(i); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    int size() const { return m_threads.size() + 1; }
+
+    /**
+     * Call 'f(threadIndex)' at every thread and wait for all of them.
+     */
+    void run(const std::function<void(int)>& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = &f;
+            m_pending = m_threads.size();
+            ++m_generation;
+        }
+        m_start.notify_all();
+
+        f(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_pending == 0; });
+        m_task = nullptr;
+    }
+
+private:
+    void worker(int index)
+    {
+        int generation = 0;
+        while (true)
+        {
+            const std::function<void(int)>* task = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_start.wait(lock, [&]() { return m_stop || m_generation != generation; });
+                if (m_stop)
+                    return;
+                generation = m_generation;
+                task = m_task;
+            }
+
+            (*task)(index);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending == 0)
+                m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    const std::function<void(int)>* m_task = nullptr;
+    int m_pending = 0;
+    int m_generation = 0;
+    bool m_stop = false;
+};
+
+class PgsPacker
+{
+public:
+
+    PgsPacker() : th(stats, refInfo) {}
+
+    /**
+     * Packed frames in structure of arrays layout, so the ref search streams through contiguous memory.
+     * Frame delta is symbolToRegs[symbol]. Masks duplicate the delta masks to avoid that lookup in the hot loops.
+     */
+    struct FrameStore
+    {
+        std::vector<uint16_t> symbols;
+        std::vector<RegState> states; //< Full regs state at the frame. Zero for delays.
+        std::vector<uint16_t> masks;
+
+        int size() const { return symbols.size(); }
+        bool empty() const { return symbols.empty(); }
+
+        void push_back(uint16_t symbol, const RegState& state, uint16_t mask)
+        {
+            symbols.push_back(symbol);
+            states.push_back(state);
+            masks.push_back(mask);
+        }
+
+        void pop_back()
+        {
+            symbols.pop_back();
+            states.pop_back();
+            masks.pop_back();
+        }
+
+        void clear()
+        {
+            symbols.clear();
+            states.clear();
+            masks.clear();
+        }
+    };
+
+    struct PackState
+    {
+        Stats stats;
+        std::map<int, int> symbolsToInflate;
+        std::vector<uint8_t> compressedData;
+        std::vector<RefInfo> refInfo;
+        std::vector<int> frameOffsets;
+        std::vector<int> timingsData;
+    };
+
+    struct PackCheckpoint
+    {
+        int pos = 0;
+        PackState state;
+    };
+
+    std::unordered_map<RegMap, uint16_t, RegMapHash> regsToSymbol;
+    std::vector<RegMap> symbolToRegs; //< Symbols 0..kMaxDelay are delays and have no regs.
+    FrameStore ayFrames;
+
+    /**
+     * Result of parsePsg: tokenized and cleaned frames before any level specific changes.
+     * It depends on the flags only, so one parse can be packed at several levels.
+     */
+    struct ParsedPsg
+    {
+        FrameStore frames;
+        std::vector<RegMap> symbolToRegs;
+        Stats stats;
+        std::array<uint8_t, 16> psgHeader{};
+        size_t inputSize = 0;
+        std::vector<uint8_t> updatedPsgData;
+        int flags = 0;
+    };
+    ParsedPsg parsedPsg;
+
+    RegMap changedRegs;
+
+    RegVector lastOrigRegs{};
+    RegVector lastCleanedRegs{};
+    RegVector prevCleanedRegs{};
+    RegVector prevTonePeriod{};
+    RegVector prevEnvelopePeriod{};
+    RegVector prevEnvelopeForm{};
+    RegVector prevNoisePeriod{};
+    std::map<int, int> symbolsToInflate;
+    std::set<int> inflatedSymbols;
+    std::map<int, int> maskUsage; //< All masks usage. stats.maskToUsage keeps indexed masks only.
+
+    Stats stats;
+    TimingsHelper th;
+
+    std::array<uint8_t, 16> psgHeader{}; //< Source PSG header, used for the PSG dump.
+    size_t inputSize = 0;
+    std::vector<uint8_t> updatedPsgData;
+    std::vector<uint8_t> compressedData;
+    std::vector<RefInfo> refInfo;
+    std::vector<int> frameOffsets;
+    int flags = kDefaultFlags;
+    bool firstFrame = false;
+    std::vector<int> timingsData;
+
+    std::vector<CutRange> cutRanges;
+
+    // Reference search index. Frames serialized as is, grouped by symbol. Only these frames can start a ref.
+    // The index keeps frames inside kMaxRefOffset window only. refWindowStart is the first frame of the window.
+    std::vector<std::deque<int>> symbolPositions;
+    std::map<uint16_t, int> indexedMasks; //< mask -> frames in window
+    int refWindowStart = 0;
+
+    std::vector<PackCheckpoint> checkpoints;
+    int repackFrom = 0; //< The first frame changed after the previous packPsg call.
+
+    int threads = 1;
+    int timeLimit = 0; //< Max frame time in t-states. Zero means the time is defined by the compression level only.
+    int lazySteps = 0; //< Greedy parse lookahead in frames. Zero means the ref is taken at once.
+    std::vector<int> refTimings;
+    std::unique_ptr<ThreadPool> threadPool;
+    std::vector<int> candidates;
+    mutable Profile profile; //< Counters are updated by the const search helpers too.
+private:
+    friend class PackerBenchmark; //< psg_bench.cpp times the private stages.
+    friend class PackerTest;      //< psg_test.cpp checks the private cover tests.
+
+    uint16_t toSymbol(const RegMap& regs)
+    {
+        auto itr = regsToSymbol.find(regs);
+        if (itr != regsToSymbol.end())
+            return itr->second;
+
+        uint16_t value = symbolToRegs.size();
+        regsToSymbol.emplace(regs, value);
+        symbolToRegs.push_back(regs);
+        return value;
+    }
+
+    // This code ported from PHP to cpp from tmk&bfox ayPacker.
+    void doCleanRegs()
+    {
+        // Normalize regs values (only usage bits).
+
+        lastCleanedRegs = lastOrigRegs;
+
+        lastCleanedRegs[1] &= 15;
+        lastCleanedRegs[3] &= 15;
+        lastCleanedRegs[5] &= 15;
+        lastCleanedRegs[6] &= 31;
+        lastCleanedRegs[7] &= 63;
+        lastCleanedRegs[8] &= 31;
+        lastCleanedRegs[9] &= 31;
+        lastCleanedRegs[10] &= 31;
+        lastCleanedRegs[13] &= 15;
+
+        lastCleanedRegs[7] &= 63;
+
+        // clean volume (do AND_16 if envelope mode)
+
+        for (int i : {8, 9, 10})
+        {
+            if (lastCleanedRegs[i] & 16)
+                lastCleanedRegs[i] = 16;
+        }
+
+        // Clean tone period.
+
+        /* toneA */
+        if (flags & cleanToneA)
+        {
+            if (lastOrigRegs[8] == 0 || (lastOrigRegs[7] & 1) != 0)
+            {
+                lastCleanedRegs[0] = prevTonePeriod[0];
+                lastCleanedRegs[1] = prevTonePeriod[1];
+                stats.unusedToneA++;
+            }
+            else
+            {
+                prevTonePeriod[0] = lastOrigRegs[0];
+                prevTonePeriod[1] = lastOrigRegs[1];
+            }
+        }
+        /* toneB */
+        if (flags & cleanToneB)
+        {
+            if (lastOrigRegs[9] == 0 || (lastOrigRegs[7] & 2) != 0)
+            {
+                lastCleanedRegs[2] = prevTonePeriod[2];
+                lastCleanedRegs[3] = prevTonePeriod[3];
+                stats.unusedToneB++;
+            }
+            else
+            {
+                prevTonePeriod[2] = lastOrigRegs[2];
+                prevTonePeriod[3] = lastOrigRegs[3];
+            }
+        }
+        /* toneC */
+        if (flags & cleanToneC)
+        {
+            if (lastOrigRegs[10] == 0 || (lastOrigRegs[7] & 4) != 0)
+            {
+                lastCleanedRegs[4] = prevTonePeriod[4];
+                lastCleanedRegs[5] = prevTonePeriod[5];
+                stats.unusedToneC++;
+            }
+            else
+            {
+                prevTonePeriod[4] = lastOrigRegs[4];
+                prevTonePeriod[5] = lastOrigRegs[5];
+            }
+        }
+
+        // Clean envelope period.
+
+        if (flags & cleanEnvelope)
+        {
+            if ((lastOrigRegs[8] & 16) == 0 && (lastOrigRegs[9] & 16) == 0 && (lastOrigRegs[10] & 16) == 0)
+            {
+                lastCleanedRegs[11] = prevEnvelopePeriod[11];
+                lastCleanedRegs[12] = prevEnvelopePeriod[12];
+                stats.unusedEnvelope++;
+            }
+            else
+            {
+                prevEnvelopePeriod[11] = lastOrigRegs[11];
+                prevEnvelopePeriod[12] = lastOrigRegs[12];
+            }
+        }
+
+        /* clean envelope form */
+
+        if (flags & cleanEnvForm)
+        {
+            if ((lastOrigRegs[8] & 16) == 0 && (lastOrigRegs[9] & 16) == 0 && (lastOrigRegs[10] & 16) == 0)
+            {
+                lastCleanedRegs[13] = prevEnvelopeForm[13];
+                stats.unusedEnvForm++;
+            }
+            else
+            {
+                prevEnvelopeForm[13] = lastOrigRegs[13];
+            }
+        }
+
+        /* clean noise period */
+
+        if (flags & cleanNoise)
+        {
+            if ((lastOrigRegs[7] & 8) != 0 && (lastOrigRegs[7] & 16) != 0 && (lastOrigRegs[7] & 32) != 0)
+            {
+                lastCleanedRegs[6] = prevNoisePeriod[6];
+                stats.unusedNoise++;
+            }
+            else
+            {
+                prevNoisePeriod[6] = lastCleanedRegs[6];
+            }
+        }
+    }
+
+    template <typename State>
+    static void extendToFullChangeIfNeed(RegMap& regs, const State& fullState, int firstThreshold, int secondThreshold)
+    {
+        const int firstRegs = RegMap::popCount(regs.mask & 0x003f);
+        const int secondRegs = RegMap::popCount(regs.mask & 0x1fc0);
+
+        if (firstRegs >= firstThreshold)
+        {
+            // Regs are about to full. Extend them to full regs.
+            for (int i = 0; i < 6; ++i)
+                regs.set(i, fullState[i]);
+        }
+
+        if (secondRegs >= secondThreshold)
+        {
+            // Regs are about to full. Extend them to full regs (exclude reg13)
+            for (int i = 6; i < 13; ++i)
+                regs.set(i, fullState[i]);
+        }
+    }
+
+    bool writeRegs()
+    {
+        if (changedRegs.empty())
+            return false;
+
+        if (prevTonePeriod.empty())
+        {
+            for (int i = 0; i < 13; ++i)
+            {
+                if (!changedRegs.has(i))
+                    changedRegs.set(i, 0);
+                lastOrigRegs[i] = 0;
+            }
+
+            // Initial value
+            prevTonePeriod = lastOrigRegs;
+            prevEnvelopePeriod = lastOrigRegs;
+            prevEnvelopeForm = lastOrigRegs;
+            prevNoisePeriod = lastOrigRegs;
+        }
+
+        int unusedEnvForm = stats.unusedEnvForm;
+        lastCleanedRegs = lastOrigRegs;
+        if (flags & cleanRegs)
+            doCleanRegs();
+
+
+        RegMap delta;
+        for (int i = 0; i < 14; ++i)
+        {
+            if (firstFrame || lastCleanedRegs[i] != prevCleanedRegs[i])
+                delta.set(i, lastCleanedRegs[i]);
+        }
+        firstFrame = false;
+        prevCleanedRegs = lastCleanedRegs;
+
+        if (changedRegs.has(13) && !(flags & cleanRegs))
+            delta.set(13, changedRegs[13]); //< Can be retrig.
+
+        changedRegs = delta;
+        if (changedRegs.empty())
+            return false;
+
+        if (flags & dumpPsg)
+        {
+            if (updatedPsgData.empty())
+                updatedPsgData.insert(updatedPsgData.end(), psgHeader.begin(), psgHeader.end());
+
+            updatedPsgData.push_back(0xff);
+            for (int i = 0; i < kRegCount; ++i)
+            {
+                if (!changedRegs.has(i))
+                    continue;
+                updatedPsgData.push_back(i);
+                updatedPsgData.push_back(changedRegs[i]);
+            }
+        }
+
+        uint16_t symbol = toSymbol(changedRegs);
+        ayFrames.push_back(symbol, packRegs(lastCleanedRegs), changedRegs.mask); //< Flush previous frame.
+        assert(isRegsCover(changedRegs.mask, changedRegs.values, changedRegs.mask, ayFrames.states.back()));
+
+        ++stats.outPsgFrames;
+
+        changedRegs.clear();
+        return true;
+    }
+
+    void writeDelay(int delay)
+    {
+        if (flags & dumpPsg)
+        {
+            for (int i = 0; i < delay; ++i)
+                updatedPsgData.push_back(0xff);
+        }
+
+        if (delay < 1)
+            return;
+
+        ++stats.outPsgFrames;
+
+        if (!ayFrames.empty() && ayFrames.symbols.back() <= kMaxDelay)
+        {
+            // Cleanup regs could wipe out regs chaning at all. That way it could be possible two delay records in a row. Merge them.
+            delay += lastDelayValue;
+            for (int i = 0; i < lastDelayBytes; ++i)
+                ayFrames.pop_back();
+        }
+
+        int prevSize = ayFrames.size();
+        lastDelayValue = delay;
+        while (delay > 0)
+        {
+            uint16_t d = std::min(kMaxDelay, delay);
+            ayFrames.push_back(d, RegState{}, 0); //< Special code for delay
+            delay -= d;
+        }
+        lastDelayBytes = ayFrames.size() - prevSize;
+
+    }
+
+    void serializeDelayTimings(int count, int trbRep, std::vector<int>& timings)
+    {
+        if (count == 1)
+        {
+            timings.push_back(th.delayTimings(TimingState::single, trbRep));
+        }
+        else
+        {
+            auto state = count > 16 ? TimingState::longFirst : TimingState::first;
+            timings.push_back(th.delayTimings(state, trbRep));
+            for (int i = 1; i < count - 1; ++i)
+                timings.push_back(th.delayTimings(TimingState::mid, trbRep));
+            timings.push_back(th.delayTimings(TimingState::last, trbRep));
+        }
+    }
+
+    void serializeDelay(int count)
+    {
+        if (count > 0)
+            serializeDelayTimings(count, 0, timingsData);
+
+        while (count > 0)
+        {
+            int value = std::min(kMaxDelay, count);
+            if (value > 16)
+            {
+                compressedData.push_back(0);
+                compressedData.push_back((uint8_t)value - 1);
+            }
+            else
+            {
+                uint8_t header = 0x10;
+                compressedData.push_back(header + value - 1);
+            }
+            count -= value;
+        }
+    };
+
+    void serializeRef(uint16_t pos, int len, uint8_t reducedLen)
+    {
+        int refTiming = serializeRefTimings(pos, len, reducedLen, 0, timingsData);
+        if (stats.level == CompressionLevel::l4 && timeLimit == 0)
+        {
+            const auto symbol = ayFrames.symbols[pos];
+            if (refTiming > kMaxTimeForL4)
+                ++symbolsToInflate[symbol];
+        }
+
+        int offset = frameOffsets[pos];
+        int recordSize = len == 1 ? 2 : 3;
+        int16_t delta = offset - compressedData.size() - recordSize;
+        if (len > 1 && stats.level < CompressionLevel::l4)
+            ++delta;
+        assert(delta < 0);
+
+        uint8_t* ptr = (uint8_t*)&delta;
+
+        if (len == 1)
+            ptr[1] &= ~0x40; // reset 6-th bit
+
+        // Serialize in network byte order
+        compressedData.push_back(ptr[1]);
+        compressedData.push_back(ptr[0]);
+
+        if (len > 1)
+            compressedData.push_back(reducedLen);
+    };
+
+    int shortRefTiming(int pos, int trbRep)
+    {
+        auto symbol = ayFrames.symbols[pos];
+        const auto& regs = symbolToRegs[symbol];
+
+        return th.shortRefTimings(regs, symbol, trbRep);
+    }
+
+    int longRefInitTiming(int pos, int symbolsLeftAtLevel)
+    {
+        auto symbol = ayFrames.symbols[pos];
+        const auto& regs = symbolToRegs[symbol];
+        return th.longRefInitTiming(pos, regs, symbol, symbolsLeftAtLevel);
+    }
+
+    bool isNestedShortRef(int pos)
+    {
+        bool result = refInfo[pos].refLen == 1;
+        return result;
+    }
+
+    bool isNestedLongRefStart(int pos)
+    {
+        bool result = refInfo[pos].refLen > 1 && refInfo[pos].refTo >= 0;
+        return result;
+    }
+
+    int serializeRefTimings(int pos, int len, int reducedLen, int prevReducedLen, std::vector<int>& timings)
+    {
+        if (len == 1)
+        {
+            timings.push_back(shortRefTiming(pos, reducedLen)); // First frame
+            return *timings.rbegin();
+        }
+
+        const int endPos = pos + len;
+
+        int result = longRefInitTiming(pos, prevReducedLen);
+        timings.push_back(result); // First frame
+        ++pos;
+        for (; pos < endPos; ++pos)
+        {
+            auto symbol = ayFrames.symbols[pos];
+            if (symbol <= kMaxDelay)
+            {
+                serializeDelayTimings(symbol, reducedLen, timings);
+            }
+            else if (isNestedShortRef(pos))
+            {
+                timings.push_back(shortRefTiming(refInfo[pos].refTo, reducedLen));
+                if (stats.level < CompressionLevel::l4)
+                    continue; //< skip decrement reducedLen
+            }
+            else if (isNestedLongRefStart(pos))
+            {
+                serializeRefTimings(refInfo[pos].refTo, refInfo[pos].refLen, refInfo[pos].reducedLen, reducedLen, timings);
+                pos += refInfo[pos].refLen - 1;
+            }
+            else
+            {
+                const auto& regs = symbolToRegs[symbol];
+                int result = th.frameTimings(regs, reducedLen, symbol);
+                timings.push_back(result);
+            }
+            --reducedLen;
+        }
+        assert(reducedLen == 0);
+        assert(pos == endPos);
+        return result;
+    }
+
+
+    void serializeFrame(uint16_t pos)
+    {
+        int prevSize = compressedData.size();
+
+        uint16_t symbol = ayFrames.symbols[pos];
+        const auto& regs = symbolToRegs[symbol];
+
+        timingsData.push_back(th.frameTimings(regs, 0, symbol));
+
+        uint8_t header1 = 0;
+
+        uint16_t longMask = longRegMask(regs);
+        bool usePsg2 = isPsg2(regs, symbol, stats);
+
+
+        auto itr = stats.maskIndex.find(longMask);
+        if (usePsg2)
+        {
+            if (itr != stats.maskIndex.end())
+            {
+                header1 = 0x20 + itr->second;
+            }
+            else
+            {
+                auto mask = (makeRegMask(regs, 0, 6) >> 2);
+                header1 = 0x40 + mask;
+            }
+            compressedData.push_back(header1);
+
+            int firstsHalfRegs = 0; //< Statistics
+            if (itr != stats.maskIndex.end())
+            {
+                for (int i = 5; i >= 0; --i)
+                {
+                    if (regs.has(i))
+                        compressedData.push_back(regs[i]);
+                }
+            }
+            else
+            {
+                for (int i = 0; i < 6; ++i)
+                {
+                    if (regs.has(i))
+                    {
+                        compressedData.push_back(regs[i]); // reg value
+                        ++firstsHalfRegs;
+                    }
+                }
+            }
+            ++stats.firstHalfRegs[firstsHalfRegs];
+            ++stats.secondHalfRegs[regs.size() - firstsHalfRegs];
+
+            uint8_t header2 = makeRegMask(regs, 6, 14);
+            header2 = reverseBits(header2);
+            if (itr == stats.maskIndex.end())
+                compressedData.push_back(header2);
+
+            if ((header2 & 0x7f) == 0 && itr == stats.maskIndex.end())
+            {
+                // play_all branch. Serialize regs in regular order
+                for (int i = 6; i < kRegCount; ++i)
+                {
+                    if (regs.has(i))
+                        compressedData.push_back(regs[i]);
+                }
+            }
+            else
+            {
+                // play_by_mask branch. Serialize regs in backward order
+                for (int i = kRegCount - 1; i >= 6; --i)
+                {
+                    if (regs.has(i))
+                        compressedData.push_back(regs[i]); // reg value
+                }
+            }
+        }
+        else
+        {
+            assert(regs.size() == 1);
+            for (int i = 0; i < kRegCount; ++i)
+            {
+                if (!regs.has(i))
+                    continue;
+                compressedData.push_back(i + 1);
+                compressedData.push_back(regs[i]); // reg value
+                header1 = 0;
+            }
+        }
+
+        stats.ownBytes += compressedData.size() - prevSize;
+    }
+
+    int serializedFrameSize(uint16_t pos)
+    {
+        const uint16_t symbol = ayFrames.symbols[pos];
+        if (symbol <= kMaxDelay)
+            return symbol <= 16 ? 1 : 2;
+
+        const auto& regs = symbolToRegs[symbol];
+
+        if (isPsg2(regs, symbol, stats))
+        {
+            int headerSize = 2;
+            uint16_t mask = longRegMask(regs);
+            if (stats.maskIndex.count(mask))
+                --headerSize;
+
+            return headerSize + regs.size();
+        }
+
+
+        return regs.size() * 2;
+    };
+
+    /**
+     * The frame the player reads at 'pos'. A frame inside a ref is played from the ref source, and the source
+     * frame can be a ref too. The played regs cover the frame itself but can have more regs.
+     */
+    int playedFrame(int pos) const
+    {
+        while (refInfo[pos].refLen > 0)
+        {
+            const int offset = refInfo[pos].offsetInRef;
+            pos = refInfo[pos - offset].refTo + offset;
+        }
+        return pos;
+    }
+
+    bool isFrameCover(int master, int slave) const
+    {
+        const uint16_t masterSymbol = ayFrames.symbols[master];
+        const uint16_t slaveSymbol = ayFrames.symbols[slave];
+        if (masterSymbol == slaveSymbol)
+            return true;
+
+        if (stats.level < l1)
+            return false;
+
+        // Slave delta values are a part of the slave full state, so the full state check covers them.
+        if (slaveSymbol <= kMaxDelay)
+            return false;
+        return isRegsCover(ayFrames.masks[master], symbolToRegs[masterSymbol].values,
+            ayFrames.masks[slave], ayFrames.states[slave]);
+    }
+
+    /**
+     * Batch version of isFrameCover for 'count' (up to 32) consecutive masters starting from 'from'.
+     * Bit j of the result is set if frame 'from + j' covers the slave.
+     */
+    uint32_t frameCoverMask(int from, int count, int slave) const
+    {
+        assert(count <= 32);
+        const uint16_t* symbols = ayFrames.symbols.data() + from;
+        const uint16_t* masks = ayFrames.masks.data() + from;
+        const uint16_t slaveSymbol = ayFrames.symbols[slave];
+        const uint16_t slaveMask = ayFrames.masks[slave];
+
+        // Cheap pass over symbols and masks first. Master reg13 is allowed only if the slave has it.
+        const uint16_t testMask = slaveMask | kReg13Bit;
+        const bool compareRegs = stats.level >= l1 && slaveSymbol > kMaxDelay;
+        uint32_t result = 0;
+        uint32_t maybeCover = 0;
+        for (int j = 0; j < count; ++j)
+        {
+            result |= uint32_t(symbols[j] == slaveSymbol) << j;
+            maybeCover |= uint32_t(compareRegs && (masks[j] & testMask) == slaveMask) << j;
+        }
+
+        const RegState& slaveState = ayFrames.states[slave];
+        for (maybeCover &= ~result; maybeCover; maybeCover &= maybeCover - 1)
+        {
+            int j = 0;
+            while (!(maybeCover & (1u << j)))
+                ++j;
+            if (isRegsCover(masks[j], symbolToRegs[symbols[j]].values, slaveMask, slaveState))
+                result |= 1u << j;
+        }
+        PSG_PROFILE(profile.add(Profile::frameCoverCalls, count));
+        PSG_PROFILE(profile.add(Profile::frameCoverHits, RegMap::popCount(result & 0xffff) + RegMap::popCount(result >> 16)));
+        return result;
+    }
+
+    void addToRefIndex(int pos)
+    {
+        const uint16_t symbol = ayFrames.symbols[pos];
+        if (symbolPositions.size() <= symbol)
+            symbolPositions.resize(symbol + 1);
+        symbolPositions[symbol].push_back(pos);
+        ++indexedMasks[ayFrames.masks[pos]];
+    }
+
+    bool isIndexed(int pos) const
+    {
+        return ayFrames.symbols[pos] > kMaxDelay && refInfo[pos].refLen == 0;
+    }
+
+    /**
+     * Move the window start forward. Frame offsets grow with 'pos', so the frames that are out of range
+     * are never needed again.
+     */
+    void advanceRefWindow(int pos)
+    {
+        for (; frameOffsets[pos] - frameOffsets[refWindowStart] + 3 > kMaxRefOffset; ++refWindowStart)
+        {
+            if (!isIndexed(refWindowStart))
+                continue;
+
+            auto& positions = symbolPositions[ayFrames.symbols[refWindowStart]];
+            assert(positions.front() == refWindowStart);
+            positions.pop_front();
+
+            auto itr = indexedMasks.find(ayFrames.masks[refWindowStart]);
+            if (--itr->second == 0)
+                indexedMasks.erase(itr);
+        }
+    }
+
+    /**
+     * Call 'f' for each indexed frame that covers frame at 'pos'. advanceRefWindow(pos) should be called first.
+     * Master frame covers the slave if master regs is a superset of the slave regs and master values
+     * match the slave full state. So, there is only one possible master symbol for each mask.
+     */
+    template <typename F>
+    void forEachRefCandidate(int pos, F&& f)
+    {
+        auto visitSymbol = [&](uint16_t symbol)
+        {
+            if (symbol >= symbolPositions.size())
+                return;
+            for (int i : symbolPositions[symbol])
+                f(i);
+        };
+
+        if (stats.level < l1)
+        {
+            visitSymbol(ayFrames.symbols[pos]);
+            return;
+        }
+
+        const uint16_t slaveMask = ayFrames.masks[pos];
+        const RegState& slaveState = ayFrames.states[pos];
+        for (const auto& [mask, count] : indexedMasks)
+        {
+            if ((mask & slaveMask) != slaveMask)
+                continue;
+            if ((mask & kReg13Bit) && !(slaveMask & kReg13Bit))
+                continue;
+
+            RegMap regs;
+            for (int i = 0; i < kRegCount; ++i)
+            {
+                if (mask & (1 << i))
+                    regs.set(i, slaveState[i]);
+            }
+            auto itr = regsToSymbol.find(regs);
+            if (itr != regsToSymbol.end())
+                visitSymbol(itr->second);
+        }
+    }
+
+    struct RefCandidate
+    {
+        int pos = -1;
+        int len = -1;
+        int reducedLen = -1;
+        int benifit = 0;
+
+        // Prefer the first position on equal benifit. Candidates are not sorted by position.
+        bool isBetterThan(const RefCandidate& other) const
+        {
+            return benifit > other.benifit || (benifit == other.benifit && pos < other.pos);
+        }
+    };
+
+    RefCandidate evaluateRef(int i, int pos, int maxLength, int maxAllowedReducedLen)
+    {
+        int chainLen = 0;
+        int reducedLen = 0;
+        int serializedSize = 0;
+        std::vector<int> sizes;
+        PSG_PROFILE(int coverCalls = 0);
+
+        for (int j = 0; j < maxLength && i + j < pos && reducedLen < maxAllowedReducedLen; ++j)
+        {
+            if (refInfo[i + j].refLen > 1 && stats.level < l4)
+                break;
+            PSG_PROFILE(++coverCalls);
+            if (!isFrameCover(playedFrame(i + j), pos + j))
+                break;
+            ++chainLen;
+            const auto& ref = refInfo[i + j];
+            if (ref.refLen == 0 || (ref.refLen > 1 && ref.refTo >= 0))
+            {
+                ++reducedLen;
+            }
+            else if (ref.refLen == 1)
+            {
+                // Don't count 1-symbol refs during ref serialization for Levels [0..3]
+                if (stats.level >= l4)
+                    ++reducedLen;
+            }
+
+            serializedSize += serializedFrameSize(pos + j);
+            sizes.push_back(serializedSize);
+        }
+
+        PSG_PROFILE(profile.add(Profile::frameCoverCalls, coverCalls));
+        PSG_PROFILE(profile.add(Profile::frameCoverHits, chainLen));
+        PSG_PROFILE(profile.add(Profile::chainSteps, chainLen));
+
+        bool truncateLastRef2 = false;
+        while (chainLen > 0 && refInfo[i + chainLen - 1].refLen > 1
+            && refInfo[i + chainLen - 1].offsetInRef < refInfo[i + chainLen - 1].refLen - 1)
+        {
+            sizes.pop_back();
+            --chainLen;
+            truncateLastRef2 = true;
+        }
+        if (truncateLastRef2)
+            --reducedLen;
+
+        if (stats.level < l4)
+        {
+            while (chainLen > 0 && refInfo[i + chainLen - 1].refLen == 1)
+            {
+                sizes.pop_back();
+                --chainLen;
+            }
+        }
+
+        int benifit = *sizes.rbegin() - (chainLen == 1 ? 2 : 3);
+        return { i, chainLen, reducedLen, benifit };
+    }
+
+    auto findRef(int pos)
+    {
+        advanceRefWindow(pos);
+        const auto best = findBestRef(pos);
+
+        const int maxChainLen = best.len;
+        const int chainPos = best.pos;
+        const int maxReducedLen = best.reducedLen;
+
+        if (maxChainLen > 1 && isLongRefTooSlow(chainPos))
+            return std::tuple<int, int, int> { -1, -1, -1}; //< Long refs is slower
+
+        return std::tuple<int, int, int> { chainPos, maxChainLen, maxReducedLen - 1};
+    }
+
+    /** The best ref for the frame at 'pos' among the indexed frames. The ref window is not moved. */
+    RefCandidate findBestRef(int pos)
+    {
+        const int maxLength = std::min(255, (int)ayFrames.size() - pos);
+        const int maxAllowedReducedLen = stats.level < l4 ? 128 : 255;
+
+        RefCandidate best;
+        PSG_PROFILE(profile.add(Profile::findRefCalls, 1));
+
+        if (!threadPool)
+        {
+            PSG_PROFILE(int examined = 0);
+            forEachRefCandidate(pos,
+                [&](int i)
+                {
+                    PSG_PROFILE(++examined);
+                    const auto candidate = evaluateRef(i, pos, maxLength, maxAllowedReducedLen);
+                    if (candidate.isBetterThan(best))
+                        best = candidate;
+                });
+            PSG_PROFILE(profile.add(Profile::refCandidates, examined));
+        }
+        else
+        {
+            candidates.clear();
+            forEachRefCandidate(pos, [this](int i) { candidates.push_back(i); });
+            PSG_PROFILE(profile.add(Profile::refCandidates, candidates.size()));
+
+            if (candidates.size() < kMinParallelCandidates)
+            {
+                for (int i : candidates)
+                {
+                    const auto candidate = evaluateRef(i, pos, maxLength, maxAllowedReducedLen);
+                    if (candidate.isBetterThan(best))
+                        best = candidate;
+                }
+            }
+            else
+            {
+                // Each thread takes its own range of candidates. Results are reduced in the thread order.
+                const int threadCount = threadPool->size();
+                std::vector<RefCandidate> results(threadCount);
+                threadPool->run(
+                    [&](int thread)
+                    {
+                        const size_t from = candidates.size() * thread / threadCount;
+                        const size_t to = candidates.size() * (thread + 1) / threadCount;
+                        for (size_t k = from; k < to; ++k)
+                        {
+                            const auto candidate = evaluateRef(candidates[k], pos, maxLength, maxAllowedReducedLen);
+                            if (candidate.isBetterThan(results[thread]))
+                                results[thread] = candidate;
+                        }
+                    });
+                for (const auto& candidate : results)
+                {
+                    if (candidate.isBetterThan(best))
+                        best = candidate;
+                }
+            }
+        }
+        return best;
+    }
+
+    /**
+     * The best ref at 'pos' if the frames before it are serialized as is. It is an estimation for the lazy matching:
+     * the ref window is left at the current frame, so it can be a bit wider than at 'pos'. Empty if there is no ref.
+     */
+    RefCandidate findLazyRef(int pos)
+    {
+        if (pos >= ayFrames.size() || ayFrames.symbols[pos] <= kMaxDelay)
+            return {};
+        const auto best = findBestRef(pos);
+        if (best.len <= 0 || (best.len > 1 && isLongRefTooSlow(best.pos)))
+            return {};
+        return best;
+    }
+
+    /** Bytes saved by a ref that covers frames [from, to). The ref is 'len' frames long, it can be cut at 'to'. */
+    int refBenifit(int from, int to, int len)
+    {
+        int result = -(len == 1 ? 2 : 3);
+        for (int j = from; j < to; ++j)
+            result += serializedFrameSize(j);
+        return result;
+    }
+
+    /**
+     * Lazy matching: look for a ref up to 'lazySteps' frames later that saves more bytes than the ref of 'len'
+     * frames at 'i' does. Only refs that start inside this one are checked, the later ones can follow it anyway.
+     * If the later ref ends after this one, the frames after this ref are covered by the next ref found there.
+     * Return the frames to serialize as is before the later ref or 0 to take the ref at 'i'.
+     */
+    int findLazyStep(int i, int len)
+    {
+        const int end = i + len;
+        const int benifit = refBenifit(i, end, len);
+        RefCandidate nextRef;
+        bool hasNextRef = false;
+        for (int step = 1; step <= lazySteps && i + step < end; ++step)
+        {
+            const auto lazyRef = findLazyRef(i + step);
+            if (lazyRef.len <= 0 || lazyRef.benifit <= benifit)
+                continue;
+
+            const int lazyEnd = i + step + lazyRef.len;
+            int tailBenifit = 0;
+            if (lazyEnd > end)
+            {
+                if (!hasNextRef)
+                {
+                    nextRef = findLazyRef(end);
+                    hasNextRef = true;
+                }
+                if (nextRef.len > 0)
+                    tailBenifit = std::max(0, refBenifit(end, std::min(end + nextRef.len, lazyEnd), nextRef.len));
+            }
+            if (lazyRef.benifit > benifit + tailBenifit)
+                return step;
+        }
+        return 0;
+    }
+
+    bool isLongRefTooSlow(int pos)
+    {
+        if (stats.level >= l2)
+            return false;
+
+        const auto symbol = ayFrames.symbols[pos];
+        const auto& regs = symbolToRegs[symbol];
+        int t = th.pl0xTimings(regs, symbol);
+        int overrun = (168 - 141) - (661 - t);
+        return overrun > 0;
+    }
+
+    /**
+     * Call 'f(len, reducedLen)' for each ref length from 'i' to 'pos' that could be serialized.
+     * It is the same ref as evaluateRef returns if it is limited by 'len'.
+     */
+    template <typename F>
+    void forEachRefLength(int i, int pos, int maxLength, int maxAllowedReducedLen, F&& f)
+    {
+        int reducedLen = 0;
+        PSG_PROFILE(int coverCalls = 0);
+        PSG_PROFILE(int coverHits = 0);
+        for (int j = 0; j < maxLength && i + j < pos && reducedLen < maxAllowedReducedLen; ++j)
+        {
+            const auto& ref = refInfo[i + j];
+            if (ref.refLen > 1 && stats.level < l4)
+                break;
+            PSG_PROFILE(++coverCalls);
+            if (!isFrameCover(playedFrame(i + j), pos + j))
+                break;
+            PSG_PROFILE(++coverHits);
+            if (ref.refLen == 0 || (ref.refLen > 1 && ref.refTo >= 0))
+                ++reducedLen;
+            else if (ref.refLen == 1 && stats.level >= l4)
+                ++reducedLen;
+
+            if (ref.refLen > 1 && ref.offsetInRef < ref.refLen - 1)
+                continue; //< Can't stop inside nested ref.
+            if (ref.refLen == 1 && stats.level < l4)
+                continue;
+            f(j + 1, reducedLen);
+        }
+        PSG_PROFILE(profile.add(Profile::frameCoverCalls, coverCalls));
+        PSG_PROFILE(profile.add(Profile::frameCoverHits, coverHits));
+        PSG_PROFILE(profile.add(Profile::chainSteps, coverHits));
+    }
+
+    struct ParseNode
+    {
+        int cost = std::numeric_limits<int>::max();
+        int from = -1;
+        int refPos = -1; //< -1 for a frame serialized as is.
+        int len = 1;
+    };
+
+    /**
+     * Find the shortest serialization of frames [from, to). Frames before 'from' are already serialized.
+     * Refs to frames inside the block suppose these frames are serialized as is. It is checked again when the
+     * block is serialized.
+     */
+    std::vector<ParseNode> parseBlock(int from, int to)
+    {
+        std::vector<ParseNode> nodes(to - from + 1);
+        nodes[0].cost = 0;
+        PSG_PROFILE(profile.add(Profile::optimalBlocks, 1));
+
+        const int maxAllowedReducedLen = stats.level < l4 ? 128 : 255;
+
+        auto relax = [&](int k, int len, int cost, int refPos)
+        {
+            auto& node = nodes[k + len - from];
+            cost += nodes[k - from].cost;
+            if (cost < node.cost)
+            {
+                node.cost = cost;
+                node.from = k;
+                node.refPos = refPos;
+                node.len = len;
+            }
+        };
+
+        advanceRefWindow(from);
+        for (int k = from; k < to; ++k)
+        {
+            relax(k, 1, serializedFrameSize(k), -1);
+            if (ayFrames.symbols[k] <= kMaxDelay)
+                continue;
+
+            const int offset = compressedData.size() + nodes[k - from].cost;
+            const int maxLength = std::min(255, to - k);
+            auto addRefs = [&](int i)
+            {
+                if (timeLimit > 0)
+                {
+                    // Check all ref frames against the time limit. Skip refs that don't improve the path first.
+                    forEachRefLength(i, k, maxLength, maxAllowedReducedLen,
+                        [&](int len, int reducedLen)
+                        {
+                            const int cost = len == 1 ? 2 : 3;
+                            if (nodes[k - from].cost + cost < nodes[k + len - from].cost && isRefInTime(i, len, reducedLen - 1))
+                                relax(k, len, cost, i);
+                        });
+                    return;
+                }
+
+                // Level 4 checks ref timings after serialization. Don't select such refs at all.
+                const bool checkTimings = stats.level == l4;
+                const bool tooSlow = isLongRefTooSlow(i) || (checkTimings && longRefInitTiming(i, 0) > kMaxTimeForL4);
+                forEachRefLength(i, k, maxLength, maxAllowedReducedLen,
+                    [&](int len, int reducedLen)
+                    {
+                        if (len > 1 && !tooSlow)
+                            relax(k, len, 3, i);
+                        else if (len == 1 && !(checkTimings && shortRefTiming(i, reducedLen - 1) > kMaxTimeForL4))
+                            relax(k, len, 2, i);
+                    });
+            };
+
+            forEachRefCandidate(k,
+                [&](int i)
+                {
+                    if (offset - frameOffsets[i] + 3 <= kMaxRefOffset)
+                        addRefs(i);
+                });
+            for (int i = from; i < k; i += 32)
+            {
+                uint32_t covers = frameCoverMask(i, std::min(32, k - i), k);
+                for (int j = 0; covers; ++j, covers >>= 1)
+                {
+                    if (covers & 1)
+                        addRefs(i + j);
+                }
+            }
+        }
+
+        return nodes;
+    }
+
+    bool isRefValid(int i, int pos, int len, int* reducedLen)
+    {
+        if (!isIndexed(i) || frameOffsets[pos] - frameOffsets[i] + 3 > kMaxRefOffset)
+            return false;
+
+        const int maxAllowedReducedLen = stats.level < l4 ? 128 : 255;
+        const auto ref = evaluateRef(i, pos, len, maxAllowedReducedLen);
+        *reducedLen = ref.reducedLen - 1;
+        if (ref.len != len)
+            return false;
+
+        // Ref timings depend on the nested refs inside the source.
+        return timeLimit == 0 || isRefInTime(i, len, *reducedLen);
+    }
+
+    // Time limit for timingsData values. The 'scf' overhead is added to them at writeTimingsFile.
+    int rawTimeLimit() const
+    {
+        return (flags & addScf) ? timeLimit - 4 : timeLimit;
+    }
+
+    bool isRefInTime(int pos, int len, int reducedLen)
+    {
+        refTimings.clear();
+        serializeRefTimings(pos, len, reducedLen, 0, refTimings);
+        return maxFrameTiming(refTimings) <= rawTimeLimit();
+    }
+
+    void packGreedy(int from)
+    {
+        // Level 4 repacks the track after inflateSymbols(). Save the state to repack changed frames only.
+        const bool needCheckpoints = stats.level == l4 && timeLimit == 0 && !(flags & optimalParse);
+        const int checkpointInterval = std::max(kPackCheckpointInterval, (int)ayFrames.size() / kMaxPackCheckpoints);
+        int nextCheckpoint = from + checkpointInterval;
+        int lazyEnd = from; //< The lazy matching found a better ref here. Frames before it are serialized as is.
+
+        for (int i = from; i < ayFrames.size();)
+        {
+            if (needCheckpoints && i >= nextCheckpoint && i >= lazyEnd)
+            {
+                checkpoints.push_back({ i, savePackState() });
+                nextCheckpoint = i + checkpointInterval;
+            }
+
+            while (frameOffsets.size() <= i)
+                frameOffsets.push_back(compressedData.size());
+
+            if (ayFrames.symbols[i] > kMaxDelay && i >= lazyEnd)
+            {
+                const auto [pos, len, reducedLen] = findRef(i);
+                const int lazyStep = len > 0 && lazySteps > 0 ? findLazyStep(i, len) : 0;
+                if (lazyStep > 0)
+                {
+                    lazyEnd = i + lazyStep;
+                }
+                else if (len > 0)
+                {
+                    packRef(i, pos, len, reducedLen);
+                    i += len;
+                    continue;
+                }
+            }
+            packFrame(i);
+            ++i;
+        }
+    }
+
+    static int maxFrameTiming(const std::vector<int>& timings)
+    {
+        return timings.empty() ? 0 : *std::max_element(timings.begin(), timings.end());
+    }
+
+    PackState savePackState() const
+    {
+        return { stats, symbolsToInflate, compressedData, refInfo, frameOffsets, timingsData };
+    }
+
+    void restorePackState(const PackState& state)
+    {
+        copyPackStats(state.stats);
+        symbolsToInflate = state.symbolsToInflate;
+        compressedData = state.compressedData;
+        refInfo = state.refInfo;
+        frameOffsets = state.frameOffsets;
+        timingsData = state.timingsData;
+
+        symbolPositions.clear();
+        symbolPositions.resize(symbolToRegs.size());
+        indexedMasks.clear();
+        refWindowStart = 0;
+        for (int i = 0; i < frameOffsets.size(); ++i)
+        {
+            if (isIndexed(i))
+                addToRefIndex(i);
+        }
+    }
+
+    // Copy statistics collected by packPsg. Other statistics belong to parsePsg.
+    void copyPackStats(const Stats& other)
+    {
+        stats.emptyCnt = other.emptyCnt;
+        stats.emptyFrames = other.emptyFrames;
+        stats.singleRepeat = other.singleRepeat;
+        stats.allRepeat = other.allRepeat;
+        stats.allRepeatFrames = other.allRepeatFrames;
+        stats.ownCnt = other.ownCnt;
+        stats.ownBytes = other.ownBytes;
+        stats.frameRegs = other.frameRegs;
+        stats.firstHalfRegs = other.firstHalfRegs;
+        stats.secondHalfRegs = other.secondHalfRegs;
+    }
+
+    /**
+     * Prepare packPsg to continue from the last checkpoint that doesn't depend on the changed frames.
+     * The ref search looks up to 255 frames forward, the lazy matching looks for the next ref after the found one.
+     * Return the frame to continue from.
+     */
+    int restoreCheckpoint()
+    {
+        const int lookahead = lazySteps > 0 ? 255 * 2 : 255;
+        while (!checkpoints.empty() && checkpoints.rbegin()->pos + lookahead > repackFrom)
+            checkpoints.pop_back();
+
+        if (checkpoints.empty())
+        {
+            PackState initialState;
+            initialState.symbolsToInflate = symbolsToInflate;
+            initialState.refInfo.resize(ayFrames.size());
+            restorePackState(initialState);
+            return 0;
+        }
+
+        auto state = checkpoints.rbegin()->state;
+        state.symbolsToInflate = symbolsToInflate;
+        restorePackState(state);
+        return checkpoints.rbegin()->pos;
+    }
+
+    void packOptimal()
+    {
+        for (int i = 0; i < ayFrames.size();)
+        {
+            while (frameOffsets.size() <= i)
+                frameOffsets.push_back(compressedData.size());
+
+            const int blockStart = i;
+            const int blockEnd = std::min((int)ayFrames.size(), i + kOptimalBlockSize);
+            const auto nodes = parseBlock(blockStart, blockEnd);
+
+            std::vector<int> path;
+            for (int k = blockEnd; k != blockStart; k = nodes[k - blockStart].from)
+                path.push_back(k);
+            std::reverse(path.begin(), path.end());
+
+            // Serialize the first half of the block only. Refs at the end of the block are limited by the block size.
+            const int commitEnd = blockEnd == ayFrames.size() ? blockEnd : blockStart + kOptimalBlockSize / 2;
+            for (int next : path)
+            {
+                if (i >= commitEnd)
+                    break;
+
+                while (frameOffsets.size() <= i)
+                    frameOffsets.push_back(compressedData.size());
+
+                const auto& node = nodes[next - blockStart];
+                if (node.refPos == -1)
+                {
+                    packFrame(i);
+                }
+                else
+                {
+                    int reducedLen = 0;
+                    if (!isRefValid(node.refPos, i, node.len, &reducedLen))
+                    {
+                        // Ref source is not serialized as is. Parse again from this frame.
+                        assert(i != blockStart);
+                        PSG_PROFILE(profile.add(Profile::optimalRestarts, 1));
+                        break;
+                    }
+                    packRef(i, node.refPos, node.len, reducedLen);
+                }
+                i = next;
+            }
+        }
+    }
+
+    void packRef(int i, int pos, int len, int reducedLen)
+    {
+        serializeRef(pos, len, reducedLen);
+        updateRefInfo(i, pos, len, reducedLen);
+
+        if (len == 1)
+            stats.singleRepeat++;
+        stats.allRepeat++;
+        stats.allRepeatFrames += len;
+    }
+
+    void packFrame(int i)
+    {
+        if (ayFrames.symbols[i] <= kMaxDelay)
+        {
+            serializeDelay(ayFrames.symbols[i]);
+            stats.emptyFrames += ayFrames.symbols[i];
+            ++stats.emptyCnt;
+        }
+        else
+        {
+            serializeFrame(i);
+            addToRefIndex(i);
+            ++stats.ownCnt;
+        }
+    }
+
+public:
+
+    void updateRefInfo(int i, int pos, int len, int reducedLen)
+    {
+        refInfo[i].refTo = pos;
+        refInfo[i].reducedLen = reducedLen;
+        for (int j = i; j < i + len; ++j)
+        {
+            assert(refInfo[j].refLen == 0);
+            refInfo[j].refLen = len;
+            refInfo[j].offsetInRef = j - i;
+        }
+        if (len > 1)
+            updateNestedLevel(pos, len, 1);
+    }
+
+    void updateNestedLevel(int pos, int len, int level)
+    {
+        for (int j = pos; j < pos + len; ++j)
+            refInfo[j].level = std::max(refInfo[j].level, level);
+        for (int j = pos; j < pos + len; ++j)
+        {
+            if (refInfo[j].refTo >= 0 && refInfo[j].refLen > 1)
+                updateNestedLevel(refInfo[j].refTo, refInfo[j].refLen, level + 1);
+        }
+    }
+
+    int cutDelay(const CutRange& range, int v)
+    {
+        if (!range.isEmpty())
+        {
+            v = std::min(range.to - stats.inPsgFrames, v);
+            if (stats.inPsgFrames < range.from)
+            {
+                if (stats.inPsgFrames + v >= range.from)
+                    v = std::min(range.from - stats.inPsgFrames, v);
+                else
+                    v = 0;
+            }
+        }
+        return v;
+    }
+
+    int parsePsg(const std::string& inputFileName)
+    {
+        PsgReader reader;
+        if (!reader.open(inputFileName))
+        {
+            std::cerr << "Can't open input file " << inputFileName << std::endl;
+            return -1;
+        }
+        return parsePsg(reader);
+    }
+
+    int parsePsg(const uint8_t* data, size_t size)
+    {
+        PsgReader reader;
+        reader.open(data, size);
+        return parsePsg(reader);
+    }
+
+    int parsePsg(PsgReader& reader)
+    {
+        PSG_PROFILE(const auto timeBegin = std::chrono::steady_clock::now());
+        psgHeader = reader.header();
+        firstFrame = true;
+
+        // Reserve symbols for delays.
+        symbolToRegs.resize(kMaxDelay + 1);
+
+        int delayCounter = 0;
+
+
+        CutRange range;
+        if (!cutRanges.empty())
+        {
+            range = cutRanges[0];
+            cutRanges.erase(cutRanges.begin());
+        }
+
+        PsgReader::Event event;
+        while (reader.next(event))
+        {
+            while (!range.isEmpty() && stats.inPsgFrames >= range.to && !cutRanges.empty())
+            {
+                range = cutRanges[0];
+                cutRanges.erase(cutRanges.begin());
+            }
+            if (!range.isEmpty() && stats.inPsgFrames >= range.to)
+                break;
+
+            if (event.type != PsgReader::EventType::regWrite)
+            {
+                bool needSkip = !range.isEmpty() && stats.inPsgFrames < range.from;
+                if (!changedRegs.empty())
+                {
+                    if (!needSkip)
+                    {
+                        if (!writeRegs())
+                            ++delayCounter; //< Regs were cleaned up.
+                    }
+                }
+
+                if (event.type == PsgReader::EventType::frameEnd)
+                {
+                    if (!needSkip)
+                        ++delayCounter;
+                    ++stats.inPsgFrames;
+                }
+                else
+                {
+                    int v = cutDelay(range, event.value);
+                    stats.inPsgFrames += event.value;
+                    delayCounter += v;
+                }
+            }
+            else
+            {
+                writeDelay(delayCounter - 1);
+                delayCounter = 0;
+
+                assert(event.reg <= 13);
+                changedRegs.set(event.reg, event.value);
+                lastOrigRegs[event.reg] = event.value;
+                ++stats.regsChange[event.reg];
+            }
+        }
+        inputSize = reader.bytesRead();
+
+        if (!changedRegs.empty())
+        {
+            if (!writeRegs())
+                ++delayCounter; //< Regs were cleaned up.
+        }
+        delayCounter = cutDelay(range, delayCounter);
+        writeDelay(delayCounter);
+
+        // Keep the level independent result and build the level specific frames from it.
+        parsedPsg.frames = std::move(ayFrames);
+        parsedPsg.symbolToRegs = std::move(symbolToRegs);
+        parsedPsg.stats = stats;
+        parsedPsg.psgHeader = psgHeader;
+        parsedPsg.inputSize = inputSize;
+        parsedPsg.updatedPsgData = updatedPsgData;
+        parsedPsg.flags = flags;
+        frameParsed();
+
+        PSG_PROFILE(profile.add(Profile::parseTime, Profile::nanoseconds(timeBegin)));
+        return 0;
+    }
+
+    /**
+     * Build frames, symbols and masks usage for the current level from the parse result.
+     * Only the levels below l3 change the parsed frames.
+     */
+    void frameParsed()
+    {
+        const auto& frames = parsedPsg.frames;
+        regsToSymbol.clear();
+        symbolToRegs.clear();
+        symbolToRegs.resize(kMaxDelay + 1);
+        ayFrames.clear();
+        maskUsage.clear();
+
+        for (int i = 0; i < frames.size(); ++i)
+        {
+            const uint16_t parsedSymbol = frames.symbols[i];
+            if (parsedSymbol <= kMaxDelay)
+            {
+                ayFrames.push_back(parsedSymbol, frames.states[i], 0);
+                continue;
+            }
+
+            RegMap delta = parsedPsg.symbolToRegs[parsedSymbol];
+            if (stats.level < l3)
+                extendToFullChangeIfNeed(delta, frames.states[i], 5, 5);
+            //else if (stats.level == l4)
+            //    extendToFullChangeIfNeed(delta, frames.states[i], 5, 6);
+
+            ayFrames.push_back(toSymbol(delta), frames.states[i], delta.mask);
+            updateMaskUsage(delta, 1);
+        }
+
+        updateMaskIndex();
+    }
+
+    void updateMaskUsage(const RegMap& regs, int delta)
+    {
+        if (regs.size() > 1 && regs.size() <= 6)
+        {
+            uint16_t mask = longRegMask(regs);
+            maskUsage[mask] += delta;
+        }
+    }
+
+    void updateMaskIndex()
+    {
+        updateMaskIndex(maskUsage);
+    }
+
+    /** Index the kPsg2iSize most used masks of 'usage'. */
+    void updateMaskIndex(const std::map<int, int>& usage)
+    {
+        stats.usageToMask.clear();
+        stats.maskToUsage.clear();
+        stats.maskIndex.clear();
+
+        for (const auto& v: usage)
+        {
+            if (v.second > 0)
+                stats.usageToMask.emplace(v.second, v.first);
+        }
+        while (stats.usageToMask.size() > kPsg2iSize)
+            stats.usageToMask.erase(stats.usageToMask.begin());
+        int i = 0;
+        for (const auto& v: stats.usageToMask)
+        {
+            stats.maskToUsage[v.second] = v.first;
+            stats.maskIndex[v.second] = i++;
+        }
+        th.updateSymbolTimings(symbolToRegs);
+    }
+
+    /**
+     * Extend frames of the symbols marked at symbolsToInflate by the previous packPsg call.
+     * Return false if there are no new symbols to inflate. Otherwise the next packPsg call repacks the changed frames.
+     */
+    bool inflateSymbols()
+    {
+        std::set<int> newSymbols;
+        for (const auto& symbol : symbolsToInflate)
+        {
+            if (inflatedSymbols.insert(symbol.first).second)
+                newSymbols.insert(symbol.first);
+        }
+        if (newSymbols.empty())
+            return false;
+
+        int firstChangedFrame = ayFrames.size();
+        for (int i = 0; i < ayFrames.size(); ++i)
+        {
+            if (newSymbols.count(ayFrames.symbols[i]) == 0)
+                continue;
+
+            const RegMap delta = symbolToRegs[ayFrames.symbols[i]];
+            RegMap regs = delta;
+            extendToFullChangeIfNeed(regs, ayFrames.states[i], 5, 5);
+            if (regs == delta)
+                continue;
+
+            updateMaskUsage(delta, -1);
+            updateMaskUsage(regs, 1);
+            ayFrames.symbols[i] = toSymbol(regs);
+            ayFrames.masks[i] = regs.mask;
+            firstChangedFrame = std::min(firstChangedFrame, i);
+        }
+
+        const auto prevMaskIndex = stats.maskIndex;
+        updateMaskIndex();
+        repackFrom = stats.maskIndex == prevMaskIndex ? firstChangedFrame : 0;
+        return true;
+    }
+
+    /**
+     * Masks usage counted by the frames that the last packPsg call serialized as is.
+     * Frames inside refs don't read the mask index, so only these ones save a byte per indexed mask.
+     */
+    std::map<int, int> ownMaskUsage() const
+    {
+        std::map<int, int> result;
+        for (int i = 0; i < ayFrames.size(); ++i)
+        {
+            if (isIndexed(i))
+            {
+                const auto& regs = symbolToRegs[ayFrames.symbols[i]];
+                if (regs.size() > 1 && regs.size() <= 6)
+                    ++result[longRegMask(regs)];
+            }
+        }
+        return result;
+    }
+
+    /**
+     * The mask index is built before packing, by the usage of all frames. Choose it again by the frames
+     * serialized as is and repack, while it makes the packed data shorter. Run it after the inflateSymbols passes.
+     * Each pass is a full repack for a gain of about 0.1%, so it runs with the repackMaskIndex flag only.
+     */
+    void optimizeMaskIndex()
+    {
+        if (!(flags & repackMaskIndex))
+            return;
+
+        for (int pass = 0; pass < kMaxMaskIndexPasses; ++pass)
+        {
+            const auto prevState = savePackState();
+            const auto prevMaskToUsage = stats.maskToUsage;
+            const auto prevUsageToMask = stats.usageToMask;
+            const auto prevMaskIndex = stats.maskIndex;
+
+            const auto usage = ownMaskUsage();
+            updateMaskIndex(usage);
+            if (maskIndexGain(usage, stats.maskIndex) > maskIndexGain(usage, prevMaskIndex))
+            {
+                // Refs are chosen again too, the gain is known after the repack only.
+                repackFrom = 0;
+                packTrack();
+                if (isBetterMaskIndexPass(prevState))
+                    continue;
+                restorePackState(prevState);
+                checkpoints.clear(); //< They belong to the dropped pass.
+            }
+
+            stats.maskToUsage = prevMaskToUsage;
+            stats.usageToMask = prevUsageToMask;
+            stats.maskIndex = prevMaskIndex;
+            th.updateSymbolTimings(symbolToRegs);
+            return;
+        }
+    }
+
+    /**
+     * A mask index pass is kept if the packed data is shorter and fits the time limit. At level 4 it must not make
+     * the longest frame longer or leave new symbols to inflate, like the optimal parse check in packTrack.
+     */
+    bool isBetterMaskIndexPass(const PackState& prevState) const
+    {
+        if (!isInTimeLimit() || compressedData.size() >= prevState.compressedData.size())
+            return false;
+        if (stats.level != l4 || timeLimit > 0)
+            return true;
+        if (maxFrameTiming(timingsData) > maxFrameTiming(prevState.timingsData))
+            return false;
+        for (const auto& symbol : symbolsToInflate)
+        {
+            if (inflatedSymbols.count(symbol.first) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    /** Bytes that 'maskIndex' saves on frames serialized as is, with the same refs. */
+    static int maskIndexGain(const std::map<int, int>& usage, const std::map<int, int>& maskIndex)
+    {
+        int result = 0;
+        for (const auto& v: usage)
+        {
+            if (maskIndex.count(v.first))
+                result += v.second;
+        }
+        return result;
+    }
+
+    bool isInTimeLimit() const
+    {
+        return timeLimit == 0 || maxFrameTiming(timingsData) <= rawTimeLimit();
+    }
+
+    int packPsg()
+    {
+        packTrack();
+        if (!isInTimeLimit())
+        {
+            // Refs always fit into the limit. Frames serialized as is and pauses can't be faster.
+            auto itr = std::max_element(timingsData.begin(), timingsData.end());
+            std::cerr << "Can't fit into " << timeLimit << "t. Frame " << itr - timingsData.begin()
+                << " takes " << *itr + timeLimit - rawTimeLimit() << "t" << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    void packTrack()
+    {
+        PSG_PROFILE(const auto timeBegin = std::chrono::steady_clock::now());
+        PSG_PROFILE(profile.add(Profile::packPasses, 1));
+        const int from = restoreCheckpoint();
+        if (from == 0)
+        {
+            compressedData.resize(kPsg2iSize * 2);
+            for (const auto& value: stats.maskIndex)
+            {
+                const int offset = value.second * 2;
+                compressedData[offset] = (uint8_t)value.first;
+                compressedData[offset+1] = (value.first >> 8);
+            }
+        }
+
+        if (threads > 1 && !threadPool)
+            threadPool.reset(new ThreadPool(threads));
+
+        if ((flags & optimalParse) || timeLimit > 0)
+        {
+            // The optimal parse doesn't know how refs affect next refs. Keep the greedy result if it is better.
+            auto initialState = savePackState();
+            packGreedy(0);
+            auto greedyState = savePackState();
+            restorePackState(initialState);
+            packOptimal();
+
+            bool useGreedy = compressedData.size() > greedyState.compressedData.size();
+            if (timeLimit > 0)
+            {
+                const int limit = rawTimeLimit();
+                const bool greedyInTime = maxFrameTiming(greedyState.timingsData) <= limit;
+                useGreedy = greedyInTime && (useGreedy || maxFrameTiming(timingsData) > limit);
+            }
+            else if (stats.level == l4)
+            {
+                // Timings are checked for the first ref frame only. Don't make the longest frame worse.
+                const int limit = std::max(kMaxTimeForL4, maxFrameTiming(greedyState.timingsData));
+                useGreedy |= maxFrameTiming(timingsData) > limit;
+            }
+            if (useGreedy)
+                restorePackState(greedyState);
+            else
+                symbolsToInflate.insert(greedyState.symbolsToInflate.begin(), greedyState.symbolsToInflate.end()); //< Repack with the same symbols as greedy packing does.
+        }
+        else
+        {
+            packGreedy(from);
+        }
+
+        compressedData.push_back(kEndTrackMarker);
+        PSG_PROFILE(profile.add(Profile::packTime, Profile::nanoseconds(timeBegin)));
+
+        for (int i = 0; i < symbolToRegs.size(); ++i)
+            ++stats.frameRegs[i <= kMaxDelay ? 1 : symbolToRegs[i].size()];
+    }
+
+    /**
+     * Parse and pack PSG data in memory. Return an empty vector on error.
+     * The packer is reset first, so it can be reused for many tracks without new allocations.
+     */
+    std::vector<uint8_t> pack(const uint8_t* psg, size_t size, const PackOptions& options)
+    {
+        reset();
+        setOptions(options);
+
+        int result = parsePsg(psg, size);
+        if (result == 0)
+            result = packPsg();
+        while (result == 0 && inflateSymbols())
+            result = packPsg();
+        if (result != 0)
+            return {};
+        optimizeMaskIndex();
+        return compressedData;
+    }
+
+    PackOptions options() const
+    {
+        PackOptions result;
+        result.level = stats.level;
+        result.flags = flags;
+        result.threads = threads;
+        result.timeLimit = timeLimit;
+        result.lazySteps = lazySteps;
+        result.cutRanges = cutRanges;
+        return result;
+    }
+
+    /**
+     * Pack a parse result of another packer. It should be parsed with the same regs cleaning flags.
+     */
+    std::vector<uint8_t> pack(const ParsedPsg& parsed, const PackOptions& options)
+    {
+        reset();
+        setOptions(options);
+        loadParsed(parsed);
+
+        int result = packPsg();
+        while (result == 0 && inflateSymbols())
+            result = packPsg();
+        if (result != 0)
+            return {};
+        optimizeMaskIndex();
+        return compressedData;
+    }
+
+    void setOptions(const PackOptions& options)
+    {
+        stats.level = options.level;
+        if (stats.addScf != bool(options.flags & addScf))
+            th.clearSymbolTimings();
+        stats.addScf = options.flags & addScf;
+        flags = options.flags;
+        threads = options.threads;
+        if (threadPool && threadPool->size() != threads)
+            threadPool.reset();
+        timeLimit = options.timeLimit;
+        lazySteps = options.lazySteps;
+        cutRanges = options.cutRanges;
+    }
+
+    /**
+     * Drop the packed track. Options are kept. Containers are cleared without releasing memory.
+     */
+    void reset()
+    {
+        regsToSymbol.clear();
+        symbolToRegs.clear();
+        ayFrames.clear();
+        changedRegs.clear();
+
+        lastOrigRegs = {};
+        lastCleanedRegs = {};
+        prevCleanedRegs = {};
+        prevTonePeriod = {};
+        prevEnvelopePeriod = {};
+        prevEnvelopeForm = {};
+        prevNoisePeriod = {};
+        symbolsToInflate.clear();
+        inflatedSymbols.clear();
+        maskUsage.clear();
+        th.clearSymbolTimings();
+
+        const auto level = stats.level;
+        const auto scf = stats.addScf;
+        stats = Stats();
+        stats.level = level;
+        stats.addScf = scf;
+
+        psgHeader = {};
+        inputSize = 0;
+        updatedPsgData.clear();
+        compressedData.clear();
+        refInfo.clear();
+        frameOffsets.clear();
+        firstFrame = false;
+        timingsData.clear();
+
+        for (auto& positions : symbolPositions)
+            positions.clear();
+        indexedMasks.clear();
+        refWindowStart = 0;
+        checkpoints.clear();
+        repackFrom = 0;
+        candidates.clear();
+
+        lastDelayValue = 0;
+        lastDelayBytes = 0;
+
+        parsedPsg.frames.clear();
+        parsedPsg.symbolToRegs.clear();
+        parsedPsg.updatedPsgData.clear();
+        profile.clear();
+    }
+
+    int writePackedFile(const std::string& outputFileName)
+    {
+        using namespace std;
+
+        ofstream fileOut;
+        fileOut.open(outputFileName, std::ios::binary | std::ios::trunc);
+        if (!fileOut.is_open())
+        {
+            std::cerr << "Can't open output file " << outputFileName << std::endl;
+            return -1;
+        }
+
+        fileOut.write((const char*)compressedData.data(), compressedData.size());
+
+        return 0;
+    }
+
+    int writeRawPsg(const std::string& outputFileName)
+    {
+        using namespace std;
+
+        ofstream fileOut;
+        fileOut.open(outputFileName, std::ios::binary | std::ios::trunc);
+        if (!fileOut.is_open())
+        {
+            std::cerr << "Can't open output file " << outputFileName << std::endl;
+            return -1;
+        }
+
+        fileOut.write((const char*) updatedPsgData.data(), updatedPsgData.size());
+
+        return 0;
+    }
+
+    int writeTimingsFile(const std::string& outputFileName)
+    {
+        if (flags & addScf)
+        {
+            for (auto& t: timingsData)
+                t += 4;
+        }
+
+        using namespace std;
+
+        ofstream fileOut;
+        fileOut.open(outputFileName, std::ios::trunc);
+        if (!fileOut.is_open())
+        {
+            std::cerr << "Can't open output file " << outputFileName << std::endl;
+            return -1;
+        }
+
+        fileOut << "frame; timings; with call" << std::endl;
+        for (int i = 0; i < timingsData.size(); ++i)
+        {
+            fileOut << i << ";" << timingsData[i] << ";" << timingsData[i]+10 << ";" << std::endl;
+            
+        }
+
+        return 0;
+    }
+
+    /** The longest frame time including the 'scf' overhead. */
+    int longestFrame() const
+    {
+        int result = maxFrameTiming(timingsData);
+        if (flags & addScf)
+            result += 4;
+        return result;
+    }
+
+    /** The last parse result. Keep a copy to pack the same track again without parsing. */
+    const ParsedPsg& parsed() const { return parsedPsg; }
+
+    /**
+     * Use the parse result instead of parsePsg. It should be parsed with the same regs cleaning flags.
+     * Call it after reset() and setOptions().
+     */
+    void loadParsed(const ParsedPsg& parsed)
+    {
+        assert((parsed.flags & kCleanFlags) == (flags & kCleanFlags));
+        if (&parsed != &parsedPsg)
+            parsedPsg = parsed;
+
+        const auto level = stats.level;
+        const auto scf = stats.addScf;
+        stats = parsedPsg.stats;
+        stats.level = level;
+        stats.addScf = scf;
+
+        psgHeader = parsedPsg.psgHeader;
+        inputSize = parsedPsg.inputSize;
+        updatedPsgData = parsedPsg.updatedPsgData;
+        frameParsed();
+    }
+
+    int maxNestedLevel() const 
+    {
+        int result = 0;
+        for (const auto& ref : refInfo)
+            result = std::max(result, ref.level);
+        return result;
+    }       
+
+    /** Profile counters and symbol table sizes. Counters are zero if PSG_PACK_PROFILE is not defined. */
+    std::vector<std::pair<std::string, uint64_t>> profileValues() const
+    {
+        std::vector<std::pair<std::string, uint64_t>> result;
+        for (int i = 0; i < Profile::counterCount; ++i)
+            result.push_back({ Profile::name(i), profile[i] });
+
+        int masks = 0;
+        for (const auto& value : maskUsage)
+            masks += value.second > 0;
+        const auto symbolCount = [](size_t size) { return uint64_t(size > kMaxDelay ? size - kMaxDelay - 1 : 0); };
+        result.push_back({ "frames", uint64_t(ayFrames.size()) });
+        result.push_back({ "parsedSymbols", symbolCount(parsedPsg.symbolToRegs.size()) });
+        result.push_back({ "symbols", symbolCount(symbolToRegs.size()) });
+        result.push_back({ "inflatedSymbols", uint64_t(inflatedSymbols.size()) });
+        result.push_back({ "masks", uint64_t(masks) });
+        return result;
+    }
+
+    /** Print the profile. Without PSG_PACK_PROFILE the counters are zero, only the symbol table sizes are printed. */
+    void printProfile(std::ostream& out) const
+    {
+        const auto values = profileValues();
+#ifdef PSG_PACK_PROFILE
+        const int first = 0;
+#else
+        out << "Profiling is not compiled in, build with PSG_PACK_PROFILE defined to get the counters." << std::endl;
+        const int first = Profile::counterCount;
+#endif
+        for (int i = first; i < values.size(); ++i)
+        {
+            const auto& value = values[i];
+            const bool isTime = value.first == Profile::name(Profile::parseTime) || value.first == Profile::name(Profile::packTime);
+            out << value.first << ":\t" << (value.first.size() < 7 ? "\t" : "") << (value.first.size() < 15 ? "\t" : "");
+            if (isTime)
+                out << value.second / 1000000.0 << " ms" << std::endl;
+            else
+                out << value.second << std::endl;
+        }
+        if (profile[Profile::frameCoverCalls] > 0)
+        {
+            out << "Cover hit rate:\t\t" << 100.0 * profile[Profile::frameCoverHits] / profile[Profile::frameCoverCalls]
+                << "%" << std::endl;
+        }
+    }
+
+    /** Write the profile as a JSON object. Times are in ns. */
+    void writeProfileJson(std::ostream& out, const std::string& indent) const
+    {
+        const auto values = profileValues();
+        out << "{" << std::endl;
+        for (int i = 0; i < values.size(); ++i)
+            out << indent << "  \"" << values[i].first << "\": " << values[i].second << "," << std::endl;
+        out << indent << "  \"profileEnabled\": " <<
+#ifdef PSG_PACK_PROFILE
+            "true"
+#else
+            "false"
+#endif
+            << std::endl << indent << "}";
+    }
+
+    private:
+        int lastDelayValue = 0;
+        int lastDelayBytes = 0;
+
+};
+
+/**
+ * Pack PSG data in memory. Return an empty vector on error.
+ * Use PgsPacker::pack() to reuse one packer for many tracks.
+ */
+std::vector<uint8_t> pack(const uint8_t* psg, size_t size, const PackOptions& options);
+std::vector<uint8_t> pack(const std::vector<uint8_t>& psg, const PackOptions& options);
@@ -0,0 +1,154 @@
+#include "psg_packer.h"
+#include "test_util.h"
+
+/**
+ * Checks of the SIMD paths against their scalar versions: equalBytesMask and the frame cover tests
+ * (isFrameCover, frameCoverMask) on seeded random register streams. The NEON path is checked on ARM builds.
+ * Returns non zero exit code on the first mismatch.
+ */
+
+static const uint32_t kSeed = 0x5eed;
+static const int kByteCompareChecks = 200000;
+static const int kFrames = 4096;
+static const int kCoverChecks = 20000;
+
+class PackerTest
+{
+public:
+    int run()
+    {
+        int result = testEqualBytesMask();
+        for (int level = l0; result == 0 && level <= l4; ++level)
+            result = testFrameCover((CompressionLevel) level);
+        if (result == 0)
+            std::cout << "All checks passed: " << m_checks << std::endl;
+        return result;
+    }
+
+private:
+    int testEqualBytesMask()
+    {
+        Random random(kSeed);
+        uint8_t a[16];
+        uint8_t b[16];
+        for (int i = 0; i < kByteCompareChecks; ++i)
+        {
+            // Fully random bytes, then copies with a few changed bytes, so both results are frequent.
+            for (int j = 0; j < 16; ++j)
+                a[j] = random.next();
+            for (int j = 0; j < 16; ++j)
+                b[j] = (i & 1) ? a[j] : random.next();
+            for (int changes = random.next(4); changes > 0; --changes)
+                b[random.next(16)] ^= 1 << random.next(8);
+
+            const uint16_t expected = equalBytesMaskScalar(a, b);
+            const uint16_t actual = equalBytesMask(a, b);
+            ++m_checks;
+            if (actual != expected)
+            {
+                std::cerr << "equalBytesMask mismatch at check " << i << ": " << actual << ", expected " << expected << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /** The cover definition written with plain loops. */
+    bool isFrameCoverScalar(int master, int slave) const
+    {
+        const auto& frames = m_packer.ayFrames;
+        if (frames.symbols[master] == frames.symbols[slave])
+            return true;
+        if (m_packer.stats.level < l1 || frames.symbols[slave] <= kMaxDelay)
+            return false;
+
+        const RegMap& masterRegs = m_packer.symbolToRegs[frames.symbols[master]];
+        const uint16_t slaveMask = frames.masks[slave];
+        if (masterRegs.has(13) && !(slaveMask & kReg13Bit))
+            return false;
+        for (int reg = 0; reg < kRegCount; ++reg)
+        {
+            const bool inSlave = slaveMask & (1 << reg);
+            if (inSlave && !masterRegs.has(reg))
+                return false;
+            if (masterRegs.has(reg) && masterRegs[reg] != frames.states[slave][reg])
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Random frames with few distinct values, so a lot of them cover each other. Delta values are a part of
+     * the frame full state as parsePsg makes them.
+     */
+    void makeFrames(Random& random, CompressionLevel level)
+    {
+        m_packer.reset();
+        m_packer.stats.level = level;
+        m_packer.symbolToRegs.resize(kMaxDelay + 1);
+        for (int i = 0; i < kFrames; ++i)
+        {
+            if (random.next(10) == 0)
+            {
+                m_packer.ayFrames.push_back(1 + random.next(kMaxDelay), RegState{}, 0);
+                continue;
+            }
+
+            RegState state{};
+            for (int reg = 0; reg < kRegCount; ++reg)
+                state[reg] = random.next(3);
+            RegMap regs;
+            const uint16_t mask = 1 + random.next((1 << kRegCount) - 1);
+            for (int reg = 0; reg < kRegCount; ++reg)
+            {
+                if (mask & (1 << reg))
+                    regs.set(reg, state[reg]);
+            }
+            m_packer.ayFrames.push_back(m_packer.toSymbol(regs), state, regs.mask);
+        }
+    }
+
+    int testFrameCover(CompressionLevel level)
+    {
+        Random random(kSeed + level);
+        makeFrames(random, level);
+        for (int i = 0; i < kCoverChecks; ++i)
+        {
+            // Partial batches are as frequent as the full ones.
+            const int count = (i & 1) ? 32 : 1 + random.next(31);
+            const int from = random.next(kFrames - count);
+            const int slave = random.next(kFrames);
+
+            const uint32_t actual = m_packer.frameCoverMask(from, count, slave);
+            uint32_t expected = 0;
+            for (int j = 0; j < count; ++j)
+            {
+                const bool cover = isFrameCoverScalar(from + j, slave);
+                expected |= uint32_t(cover) << j;
+                ++m_checks;
+                if (m_packer.isFrameCover(from + j, slave) != cover)
+                {
+                    std::cerr << "isFrameCover mismatch at level " << level << ": master " << from + j
+                        << ", slave " << slave << ", expected " << cover << std::endl;
+                    return -1;
+                }
+            }
+            if (actual != expected)
+            {
+                std::cerr << "frameCoverMask mismatch at level " << level << ": masters " << from << ".." << from + count - 1
+                    << ", slave " << slave << ": " << actual << ", expected " << expected << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    PgsPacker m_packer;
+    int m_checks = 0;
+};
+
+int main()
+{
+    PackerTest test;
+    return test.run() == 0 ? 0 : 1;
+}
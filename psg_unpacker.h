@@ -0,0 +1,428 @@
+#pragma once
+
+#include "psg_packer.h"
+
+/**
+ * Expands packed data back into per frame register writes. It runs the same state machine as the Z80 players:
+ * fast_psg_player.asm for levels 0..3 and l4_psg_player.asm (nested refs stack) for levels 4..5.
+ * Every player call gives a frame, the end of track marker finishes the decoding.
+ */
+class PsgUnpacker
+{
+public:
+
+    static const int kMaxNestedLevel = 4; //< MAX_NESTED_LEVEL of l4_psg_player.asm
+    static const int kMaxFrames = 1 << 24; //< Protection against looped refs in a broken data.
+
+    std::vector<RegMap> frames; //< Regs written at each frame. Pause frames are empty.
+    int maxNestedLevel = 0;     //< The deepest nested ref. Level 4 player only.
+
+    /**
+     * Decode the packed data for the player of the 'level'. Return 0 on success.
+     */
+    int unpack(const std::vector<uint8_t>& data, int level)
+    {
+        m_data = &data;
+        m_l4Player = level >= l4;
+        frames.clear();
+        maxNestedLevel = 0;
+
+        if (data.size() < kPsg2iSize * 2 + 1)
+            return error(0, "the data is too short");
+        for (int i = 0; i < kPsg2iSize; ++i)
+            m_masks[i] = data[i * 2] + data[i * 2 + 1] * 256;
+
+        // mus_init
+        m_pos = kPsg2iSize * 2;
+        m_pauseRep = 0;
+        m_trbRep = 0;
+        m_trbRest = 0;
+        m_stack.assign(1, StackEntry());
+        m_stack[0].pos = m_pos;
+        m_level = 0;
+
+        bool finished = false;
+        while (!finished)
+        {
+            if (frames.size() >= kMaxFrames)
+                return error(m_pos, "too many frames");
+            RegMap regs;
+            const int result = m_l4Player ? playL4(regs, finished) : playFast(regs, finished);
+            if (result != 0)
+                return result;
+            if (!finished)
+                frames.push_back(regs);
+        }
+        return 0;
+    }
+
+    /**
+     * Compare decoded frames with the parse result: the full regs state after every frame
+     * and reg 13 writes, because a write restarts the envelope. Return 0 if they match.
+     */
+    int verify(const PgsPacker::ParsedPsg& parsed) const
+    {
+        RegState expected{};
+        RegState decoded{};
+        int frame = 0;
+        for (int i = 0; i < parsed.frames.size(); ++i)
+        {
+            const uint16_t symbol = parsed.frames.symbols[i];
+            const int count = symbol <= kMaxDelay ? symbol : 1;
+            const RegMap empty;
+            const RegMap& delta = symbol <= kMaxDelay ? empty : parsed.symbolToRegs[symbol];
+            for (int reg = 0; reg < kRegCount; ++reg)
+            {
+                if (delta.has(reg))
+                    expected[reg] = delta[reg];
+            }
+
+            for (int j = 0; j < count; ++j, ++frame)
+            {
+                if (frame >= frames.size())
+                {
+                    std::cerr << "Verification failed: " << frames.size() << " frames are decoded, expected more" << std::endl;
+                    return -1;
+                }
+                const RegMap& regs = frames[frame];
+                for (int reg = 0; reg < kRegCount; ++reg)
+                {
+                    if (regs.has(reg))
+                        decoded[reg] = regs[reg];
+                }
+
+                const bool envelopeRestart = j == 0 && delta.has(13);
+                if (regs.has(13) != envelopeRestart)
+                {
+                    std::cerr << "Verification failed at frame " << frame << ": reg 13 is "
+                        << (envelopeRestart ? "not written" : "written") << std::endl;
+                    return -1;
+                }
+                for (int reg = 0; reg < kRegCount; ++reg)
+                {
+                    if (decoded[reg] != expected[reg])
+                    {
+                        std::cerr << "Verification failed at frame " << frame << ": reg " << reg << " is "
+                            << (int) decoded[reg] << ", expected " << (int) expected[reg] << std::endl;
+                        return -1;
+                    }
+                }
+            }
+        }
+        if (frame != frames.size())
+        {
+            std::cerr << "Verification failed: " << frames.size() << " frames are decoded, expected " << frame << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+private:
+
+    enum class Record
+    {
+        frame,
+        pause,
+        end
+    };
+
+    struct StackEntry
+    {
+        uint8_t counter = 0;
+        int pos = 0;
+    };
+
+    int error(int pos, const char* message) const
+    {
+        std::cerr << "Can't unpack at offset " << pos << ", frame " << frames.size() << ": " << message << std::endl;
+        return -1;
+    }
+
+    bool read(int& pos, uint8_t& value) const
+    {
+        if (pos >= m_data->size())
+            return false;
+        value = (*m_data)[pos++];
+        return true;
+    }
+
+    /**
+     * pl0x: play the record at 'pos' and move 'pos' after it. 'pause' gets the pause length in frames.
+     */
+    int playRecord(int& pos, RegMap& regs, Record& record, int& pause) const
+    {
+        const int start = pos;
+        uint8_t header;
+        if (!read(pos, header))
+            return error(start, "unexpected end of data");
+        record = Record::frame;
+
+        if (header & 0x80)
+            return error(start, "a ref to a ref");
+
+        uint8_t value = 0;
+        if (header & 0x40)
+        {
+            // PSG2. Zero bit means the reg is present.
+            for (int reg = 0; reg < 6; ++reg)
+            {
+                if (!(header & (0x20 >> reg)))
+                {
+                    if (!read(pos, value))
+                        return error(start, "unexpected end of data");
+                    regs.set(reg, value);
+                }
+            }
+            uint8_t mask2;
+            if (!read(pos, mask2))
+                return error(start, "unexpected end of data");
+            return readRegs6To13(pos, mask2, (mask2 & 0x7f) == 0, regs) ? 0 : error(start, "unexpected end of data");
+        }
+        if (header & 0x20)
+        {
+            // PSG2i
+            const uint16_t mask = m_masks[header & 0x1f];
+            for (int reg = 5; reg >= 0; --reg)
+            {
+                if (!(mask & (4 << reg)))
+                {
+                    if (!read(pos, value))
+                        return error(start, "unexpected end of data");
+                    regs.set(reg, value);
+                }
+            }
+            return readRegs6To13(pos, mask >> 8, false, regs) ? 0 : error(start, "unexpected end of data");
+        }
+        if (header & 0x10)
+        {
+            record = Record::pause;
+            pause = (header & 0x0f) + 1;
+            return 0;
+        }
+        if (header == 0)
+        {
+            if (!read(pos, value))
+                return error(start, "unexpected end of data");
+            record = Record::pause;
+            pause = value + 1;
+            return 0;
+        }
+        if (header == kEndTrackMarker)
+        {
+            record = Record::end;
+            return 0;
+        }
+
+        // PSG1
+        if (!read(pos, value))
+            return error(start, "unexpected end of data");
+        regs.set(header - 1, value);
+        return 0;
+    }
+
+    /** play_all_6_13 reads the regs in forward order, play_by_mask_13_6 in backward order. */
+    bool readRegs6To13(int& pos, uint8_t mask, bool playAll, RegMap& regs) const
+    {
+        uint8_t value = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            const int reg = playAll ? 6 + i : 13 - i;
+            if (!(mask & (1 << (reg - 6))))
+            {
+                if (!read(pos, value))
+                    return false;
+                regs.set(reg, value);
+            }
+        }
+        return true;
+    }
+
+    /** Play a frame of a ref. Refs never point to pauses, the player can't return from them. */
+    int playRefFrame(int& pos, RegMap& regs) const
+    {
+        const int start = pos;
+        if (start < kPsg2iSize * 2 || start >= m_data->size())
+            return error(start, "a ref out of data");
+        Record record;
+        int pause = 0;
+        const int result = playRecord(pos, regs, record, pause);
+        if (result == 0 && record != Record::frame)
+            return error(start, "a ref to a pause or the end of track");
+        return result;
+    }
+
+    bool readRef(int& pos, int& delta) const
+    {
+        uint8_t hi, lo;
+        if (!read(pos, hi) || !read(pos, lo))
+            return false;
+        uint16_t offset = hi * 256 + lo;
+        if (!(hi & 0x40))
+            offset |= 0x4000; //< The bit is reset for a single frame ref.
+        delta = (int16_t) offset;
+        return true;
+    }
+
+    /** trb_rep of fast_psg_player: count down frames of the current ref and return after the ref record at zero. */
+    void fastTrbRep()
+    {
+        const uint8_t value = m_trbRep - 1;
+        if (value & 0x80)
+            return; //< Not in a ref.
+        m_trbRep = value;
+        if (value == 0)
+            m_pos = m_trbRest + 1;
+    }
+
+    int playFast(RegMap& regs, bool& finished)
+    {
+        if (m_pauseRep > 0)
+        {
+            if (--m_pauseRep == 0)
+                fastTrbRep();
+            return 0;
+        }
+
+        const int start = m_pos;
+        uint8_t header;
+        if (!read(m_pos, header))
+            return error(start, "unexpected end of data");
+        if (header & 0x80)
+        {
+            int delta;
+            m_pos = start;
+            if (!readRef(m_pos, delta))
+                return error(start, "unexpected end of data");
+            int target = m_pos + delta;
+            if (header & 0x40)
+            {
+                // pl11: the ref length follows the offset. The offset is counted from the length byte.
+                if (m_pos >= m_data->size())
+                    return error(start, "unexpected end of data");
+                m_trbRep = (*m_data)[m_pos];
+                m_trbRest = m_pos;
+                const int result = playRefFrame(target, regs);
+                m_pos = target;
+                return result;
+            }
+            // pl10: a single frame, doesn't count in the ref length.
+            return playRefFrame(target, regs);
+        }
+
+        m_pos = start;
+        Record record;
+        int pause = 0;
+        const int result = playRecord(m_pos, regs, record, pause);
+        if (result != 0)
+            return result;
+        if (record == Record::end)
+        {
+            finished = true;
+            return 0;
+        }
+        if (record == Record::pause && pause > 1)
+        {
+            m_pauseRep = pause - 1;
+            return 0;
+        }
+        fastTrbRep();
+        return 0;
+    }
+
+    /** trb_rep of l4_psg_player: count down frames of the current level and return to the previous one at zero. */
+    int l4TrbRep()
+    {
+        if (--m_stack[m_level].counter == 0)
+        {
+            if (m_level == 0)
+                return error(m_pos, "the refs stack underflow");
+            --m_level;
+        }
+        return 0;
+    }
+
+    int playL4(RegMap& regs, bool& finished)
+    {
+        if (m_pauseRep > 0)
+        {
+            if (--m_pauseRep == 0)
+                return l4TrbRep();
+            return 0;
+        }
+
+        int pos = m_stack[m_level].pos;
+        const int start = pos;
+        uint8_t header;
+        if (!read(pos, header))
+            return error(start, "unexpected end of data");
+        if (header & 0x80)
+        {
+            int delta;
+            pos = start;
+            if (!readRef(pos, delta))
+                return error(start, "unexpected end of data");
+            if (header & 0x40)
+            {
+                // pl11. The current ref is finished by this record: reuse its level instead of the nested one.
+                uint8_t counter;
+                if (!read(pos, counter))
+                    return error(start, "unexpected end of data");
+                if (--m_stack[m_level].counter != 0)
+                {
+                    m_stack[m_level].pos = pos;
+                    ++m_level;
+                    if (m_level >= m_stack.size())
+                        m_stack.resize(m_level + 1);
+                    maxNestedLevel = std::max(maxNestedLevel, m_level);
+                }
+                m_stack[m_level].counter = counter;
+                int target = pos + delta;
+                const int result = playRefFrame(target, regs);
+                m_stack[m_level].pos = target;
+                return result;
+            }
+
+            // pl10. A single frame counts in the ref length.
+            m_stack[m_level].pos = pos;
+            int target = pos + delta;
+            const int result = playRefFrame(target, regs);
+            if (result != 0)
+                return result;
+            return l4TrbRep();
+        }
+
+        pos = start;
+        Record record;
+        int pause = 0;
+        const int result = playRecord(pos, regs, record, pause);
+        if (result != 0)
+            return result;
+        if (record == Record::end)
+        {
+            finished = true;
+            return 0;
+        }
+        m_stack[m_level].pos = pos;
+        if (record == Record::pause && pause > 1)
+        {
+            m_pauseRep = pause - 1;
+            return 0;
+        }
+        m_stack[0].counter = 0; //< after_play_frame: the top level never returns.
+        return l4TrbRep();
+    }
+
+    const std::vector<uint8_t>* m_data = nullptr;
+    std::array<uint16_t, kPsg2iSize> m_masks{};
+    bool m_l4Player = false;
+    int m_pos = 0;
+    int m_pauseRep = 0;
+
+    // fast_psg_player
+    uint8_t m_trbRep = 0;
+    int m_trbRest = 0;
+
+    // l4_psg_player
+    std::vector<StackEntry> m_stack;
+    int m_level = 0;
+};
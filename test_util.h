@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Helpers shared by psg_test and psg_bench.
+ */
+
+/** xorshift32. The test streams and the synthetic tracks must be the same on every platform. */
+class Random
+{
+public:
+    Random(uint32_t seed) : m_state(seed ? seed : 1) {}
+
+    uint32_t next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+
+    int next(int range) { return next() % range; }
+
+private:
+    uint32_t m_state;
+};
@@ -0,0 +1,1583 @@
+#pragma once
+
+#include "psg_unpacker.h"
+
+#include <cctype>
+#include <sstream>
+
+/**
+ * Minimal Z80 core: documented instructions without IX/IY, exact t-states, no memory contention.
+ * Undocumented flag bits 3 and 5 are not emulated, the players don't depend on them.
+ */
+class Z80
+{
+public:
+
+    enum FlagBits
+    {
+        flagC = 0x01,
+        flagN = 0x02,
+        flagPV = 0x04,
+        flagH = 0x10,
+        flagZ = 0x40,
+        flagS = 0x80
+    };
+
+    std::vector<uint8_t> memory = std::vector<uint8_t>(65536);
+    uint8_t a = 0, f = 0, b = 0, c = 0, d = 0, e = 0, h = 0, l = 0;
+    uint8_t a1 = 0, f1 = 0, b1 = 0, c1 = 0, d1 = 0, e1 = 0, h1 = 0, l1 = 0; //< Shadow registers.
+    uint16_t pc = 0;
+    uint16_t sp = 0;
+    uint64_t tstates = 0;
+    int breakpoint = -1;         //< 'breakpointHit' is set when the execution reaches this address.
+    bool breakpointHit = false;
+
+    std::function<void(uint16_t port, uint8_t value)> out;
+
+    uint16_t bc() const { return b * 256 + c; }
+    uint16_t de() const { return d * 256 + e; }
+    uint16_t hl() const { return h * 256 + l; }
+
+    void push(uint16_t value)
+    {
+        memory[--sp] = value >> 8;
+        memory[--sp] = (uint8_t) value;
+    }
+
+    /**
+     * Call the subroutine at 'address' and run it until it returns. Return 0 on success,
+     * -1 on an unsupported opcode or if it doesn't return in 'maxTstates'.
+     */
+    int call(uint16_t address, uint64_t maxTstates)
+    {
+        const uint16_t returnAddress = pc;
+        const uint16_t returnSp = sp;
+        push(returnAddress);
+        pc = address;
+        const uint64_t limit = tstates + maxTstates;
+        while (pc != returnAddress || sp != returnSp)
+        {
+            if (pc == breakpoint)
+                breakpointHit = true;
+            if (step() != 0)
+                return -1;
+            if (tstates > limit)
+            {
+                std::cerr << "Z80: the call to #" << std::hex << address << std::dec << " doesn't return" << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /** Execute one instruction. */
+    int step()
+    {
+        const uint16_t opAddress = pc;
+        const uint8_t op = fetch();
+        const int x = op >> 6;
+        const int y = (op >> 3) & 7;
+        const int z = op & 7;
+        const int p = y >> 1;
+
+        if (x == 1)
+        {
+            if (op == 0x76)
+                return unsupported(opAddress, op);
+            setReg(y, reg(z));
+            tstates += (y == 6 || z == 6) ? 7 : 4;
+            return 0;
+        }
+        if (x == 2)
+        {
+            alu(y, reg(z));
+            tstates += z == 6 ? 7 : 4;
+            return 0;
+        }
+
+        switch (op)
+        {
+            case 0x00: tstates += 4; return 0;                                           // nop
+            case 0x08: std::swap(a, a1); std::swap(f, f1); tstates += 4; return 0;      // ex af,af'
+            case 0x10:                                                                    // djnz
+            {
+                const int8_t offset = (int8_t) fetch();
+                if (--b != 0)
+                {
+                    pc += offset;
+                    tstates += 13;
+                }
+                else
+                {
+                    tstates += 8;
+                }
+                return 0;
+            }
+            case 0x18: pc += (int8_t) fetch(); tstates += 12; return 0;                  // jr e
+            case 0x02: memory[bc()] = a; tstates += 7; return 0;                         // ld (bc),a
+            case 0x12: memory[de()] = a; tstates += 7; return 0;                         // ld (de),a
+            case 0x0a: a = memory[bc()]; tstates += 7; return 0;                         // ld a,(bc)
+            case 0x1a: a = memory[de()]; tstates += 7; return 0;                         // ld a,(de)
+            case 0x22: write16(fetch16(), hl()); tstates += 16; return 0;                // ld (nn),hl
+            case 0x2a: setPair(2, read16(fetch16())); tstates += 16; return 0;          // ld hl,(nn)
+            case 0x32: memory[fetch16()] = a; tstates += 13; return 0;                   // ld (nn),a
+            case 0x3a: a = memory[fetch16()]; tstates += 13; return 0;                   // ld a,(nn)
+            case 0x07: rotateA(0); return 0;                                              // rlca
+            case 0x0f: rotateA(1); return 0;                                              // rrca
+            case 0x17: rotateA(2); return 0;                                              // rla
+            case 0x1f: rotateA(3); return 0;                                              // rra
+            case 0x2f: a = ~a; f |= flagH | flagN; tstates += 4; return 0;               // cpl
+            case 0x37: f = (f & (flagS | flagZ | flagPV)) | flagC; tstates += 4; return 0; // scf
+            case 0x3f:                                                                    // ccf
+                f = (f & (flagS | flagZ | flagPV)) | ((f & flagC) ? flagH : flagC);
+                tstates += 4;
+                return 0;
+            case 0xc3: pc = fetch16(); tstates += 10; return 0;                          // jp nn
+            case 0xc9: pc = pop(); tstates += 10; return 0;                              // ret
+            case 0xcd:                                                                    // call nn
+            {
+                const uint16_t address = fetch16();
+                push(pc);
+                pc = address;
+                tstates += 17;
+                return 0;
+            }
+            case 0xcb: return prefixCb();
+            case 0xed: return prefixEd(opAddress);
+            case 0xd3: writePort(a * 256 + fetch(), a); tstates += 11; return 0;        // out (n),a
+            case 0xd9:                                                                    // exx
+                std::swap(b, b1); std::swap(c, c1);
+                std::swap(d, d1); std::swap(e, e1);
+                std::swap(h, h1); std::swap(l, l1);
+                tstates += 4;
+                return 0;
+            case 0xe3:                                                                    // ex (sp),hl
+            {
+                const uint16_t value = read16(sp);
+                write16(sp, hl());
+                setPair(2, value);
+                tstates += 19;
+                return 0;
+            }
+            case 0xe9: pc = hl(); tstates += 4; return 0;                                // jp (hl)
+            case 0xeb: std::swap(d, h); std::swap(e, l); tstates += 4; return 0;        // ex de,hl
+            case 0xf3:
+            case 0xfb: tstates += 4; return 0;                                           // di, ei
+            case 0xf9: sp = hl(); tstates += 6; return 0;                                // ld sp,hl
+        }
+
+        if (x == 0)
+        {
+            switch (z)
+            {
+                case 0:
+                    if (y >= 4)
+                    {
+                        // jr cc,e
+                        const int8_t offset = (int8_t) fetch();
+                        if (condition(y - 4))
+                        {
+                            pc += offset;
+                            tstates += 12;
+                        }
+                        else
+                        {
+                            tstates += 7;
+                        }
+                        return 0;
+                    }
+                    break;
+                case 1:
+                    if (y & 1)
+                    {
+                        // add hl,rr
+                        const uint32_t value = hl() + pair(p);
+                        f = (f & (flagS | flagZ | flagPV)) | (((hl() ^ pair(p) ^ value) >> 8) & flagH) | (value >> 16);
+                        setPair(2, (uint16_t) value);
+                        tstates += 11;
+                    }
+                    else
+                    {
+                        setPair(p, fetch16());
+                        tstates += 10;
+                    }
+                    return 0;
+                case 3:
+                    setPair(p, pair(p) + ((y & 1) ? -1 : 1));
+                    tstates += 6;
+                    return 0;
+                case 4:
+                case 5:
+                {
+                    const uint8_t value = reg(y);
+                    const uint8_t result = value + (z == 4 ? 1 : -1);
+                    f = (f & flagC) | szFlags(result);
+                    if (z == 4)
+                        f |= ((value & 0x0f) == 0x0f ? flagH : 0) | (value == 0x7f ? flagPV : 0);
+                    else
+                        f |= flagN | ((value & 0x0f) == 0 ? flagH : 0) | (value == 0x80 ? flagPV : 0);
+                    setReg(y, result);
+                    tstates += y == 6 ? 11 : 4;
+                    return 0;
+                }
+                case 6:
+                    setReg(y, fetch());
+                    tstates += y == 6 ? 10 : 7;
+                    return 0;
+            }
+            return unsupported(opAddress, op);
+        }
+
+        // x == 3
+        switch (z)
+        {
+            case 0:
+                if (condition(y))
+                {
+                    pc = pop();
+                    tstates += 11;
+                }
+                else
+                {
+                    tstates += 5;
+                }
+                return 0;
+            case 1:
+                if (!(y & 1))
+                {
+                    setPair2(p, pop());
+                    tstates += 10;
+                    return 0;
+                }
+                break;
+            case 2:
+            {
+                const uint16_t address = fetch16();
+                if (condition(y))
+                    pc = address;
+                tstates += 10;
+                return 0;
+            }
+            case 4:
+            {
+                const uint16_t address = fetch16();
+                if (condition(y))
+                {
+                    push(pc);
+                    pc = address;
+                    tstates += 17;
+                }
+                else
+                {
+                    tstates += 10;
+                }
+                return 0;
+            }
+            case 5:
+                if (!(y & 1))
+                {
+                    push(pair2(p));
+                    tstates += 11;
+                    return 0;
+                }
+                break;
+            case 6:
+                alu(y, fetch());
+                tstates += 7;
+                return 0;
+            case 7:
+                push(pc);
+                pc = y * 8;
+                tstates += 11;
+                return 0;
+        }
+        return unsupported(opAddress, op);
+    }
+
+private:
+
+    uint8_t fetch() { return memory[pc++]; }
+
+    uint16_t fetch16()
+    {
+        const uint16_t value = read16(pc);
+        pc += 2;
+        return value;
+    }
+
+    uint16_t read16(uint16_t address) const { return memory[address] + memory[(uint16_t) (address + 1)] * 256; }
+
+    void write16(uint16_t address, uint16_t value)
+    {
+        memory[address] = (uint8_t) value;
+        memory[(uint16_t) (address + 1)] = value >> 8;
+    }
+
+    uint16_t pop()
+    {
+        const uint16_t value = read16(sp);
+        sp += 2;
+        return value;
+    }
+
+    void writePort(uint16_t port, uint8_t value)
+    {
+        if (out)
+            out(port, value);
+    }
+
+    /** Register by the opcode index: b, c, d, e, h, l, (hl), a. */
+    uint8_t reg(int index) const
+    {
+        switch (index)
+        {
+            case 0: return b;
+            case 1: return c;
+            case 2: return d;
+            case 3: return e;
+            case 4: return h;
+            case 5: return l;
+            case 6: return memory[hl()];
+            default: return a;
+        }
+    }
+
+    void setReg(int index, uint8_t value)
+    {
+        switch (index)
+        {
+            case 0: b = value; break;
+            case 1: c = value; break;
+            case 2: d = value; break;
+            case 3: e = value; break;
+            case 4: h = value; break;
+            case 5: l = value; break;
+            case 6: memory[hl()] = value; break;
+            default: a = value; break;
+        }
+    }
+
+    /** Register pair by the opcode index: bc, de, hl, sp. */
+    uint16_t pair(int index) const
+    {
+        switch (index)
+        {
+            case 0: return bc();
+            case 1: return de();
+            case 2: return hl();
+            default: return sp;
+        }
+    }
+
+    void setPair(int index, uint16_t value)
+    {
+        switch (index)
+        {
+            case 0: b = value >> 8; c = (uint8_t) value; break;
+            case 1: d = value >> 8; e = (uint8_t) value; break;
+            case 2: h = value >> 8; l = (uint8_t) value; break;
+            default: sp = value; break;
+        }
+    }
+
+    /** Register pair of push/pop: bc, de, hl, af. */
+    uint16_t pair2(int index) const { return index == 3 ? a * 256 + f : pair(index); }
+
+    void setPair2(int index, uint16_t value)
+    {
+        if (index != 3)
+        {
+            setPair(index, value);
+            return;
+        }
+        a = value >> 8;
+        f = (uint8_t) value;
+    }
+
+    bool condition(int index) const
+    {
+        static const uint8_t kFlags[4] = { flagZ, flagC, flagPV, flagS };
+        const bool isSet = f & kFlags[index >> 1];
+        return (index & 1) ? isSet : !isSet;
+    }
+
+    static uint8_t szFlags(uint8_t value) { return (value & flagS) | (value == 0 ? flagZ : 0); }
+
+    static uint8_t parity(uint8_t value)
+    {
+        value ^= value >> 4;
+        value ^= value >> 2;
+        value ^= value >> 1;
+        return (value & 1) ? 0 : flagPV;
+    }
+
+    /** add, adc, sub, sbc, and, xor, or, cp */
+    void alu(int operation, uint8_t value)
+    {
+        const int carry = (operation == 1 || operation == 3) ? (f & flagC) : 0;
+        if (operation <= 1)
+        {
+            const int result = a + value + carry;
+            f = szFlags((uint8_t) result) | (((a ^ value ^ result) & 0x10) ? flagH : 0)
+                | (((a ^ ~value) & (a ^ result) & 0x80) ? flagPV : 0) | (result > 0xff ? flagC : 0);
+            a = (uint8_t) result;
+        }
+        else if (operation == 2 || operation == 3 || operation == 7)
+        {
+            const int result = a - value - carry;
+            f = szFlags((uint8_t) result) | flagN | (((a ^ value ^ result) & 0x10) ? flagH : 0)
+                | (((a ^ value) & (a ^ result) & 0x80) ? flagPV : 0) | (result < 0 ? flagC : 0);
+            if (operation != 7)
+                a = (uint8_t) result;
+        }
+        else
+        {
+            if (operation == 4)
+                a &= value;
+            else if (operation == 5)
+                a ^= value;
+            else
+                a |= value;
+            f = szFlags(a) | parity(a) | (operation == 4 ? flagH : 0);
+        }
+    }
+
+    /** rlca, rrca, rla, rra */
+    void rotateA(int operation)
+    {
+        const uint8_t carryIn = f & flagC;
+        uint8_t carryOut;
+        if (operation == 0 || operation == 2)
+        {
+            carryOut = a >> 7;
+            a = (a << 1) | (operation == 0 ? carryOut : carryIn);
+        }
+        else
+        {
+            carryOut = a & 1;
+            a = (a >> 1) | ((operation == 1 ? carryOut : carryIn) << 7);
+        }
+        f = (f & (flagS | flagZ | flagPV)) | carryOut;
+        tstates += 4;
+    }
+
+    int prefixCb()
+    {
+        const uint8_t op = fetch();
+        const int x = op >> 6;
+        const int y = (op >> 3) & 7;
+        const int z = op & 7;
+        uint8_t value = reg(z);
+        if (x == 1)
+        {
+            // bit y,r
+            f = (f & flagC) | flagH | ((value & (1 << y)) ? (y == 7 ? flagS : 0) : (flagZ | flagPV));
+            tstates += z == 6 ? 12 : 8;
+            return 0;
+        }
+        if (x == 0)
+        {
+            const uint8_t carryIn = f & flagC;
+            uint8_t carryOut;
+            switch (y)
+            {
+                case 0: carryOut = value >> 7; value = (value << 1) | carryOut; break;               // rlc
+                case 1: carryOut = value & 1; value = (value >> 1) | (carryOut << 7); break;         // rrc
+                case 2: carryOut = value >> 7; value = (value << 1) | carryIn; break;                // rl
+                case 3: carryOut = value & 1; value = (value >> 1) | (carryIn << 7); break;          // rr
+                case 4: carryOut = value >> 7; value <<= 1; break;                                   // sla
+                case 5: carryOut = value & 1; value = (value >> 1) | (value & 0x80); break;          // sra
+                case 6: carryOut = value >> 7; value = (value << 1) | 1; break;                      // sll
+                default: carryOut = value & 1; value >>= 1; break;                                   // srl
+            }
+            f = szFlags(value) | parity(value) | carryOut;
+        }
+        else if (x == 2)
+        {
+            value &= ~(1 << y);
+        }
+        else
+        {
+            value |= 1 << y;
+        }
+        setReg(z, value);
+        tstates += z == 6 ? 15 : 8;
+        return 0;
+    }
+
+    int prefixEd(uint16_t opAddress)
+    {
+        const uint8_t op = fetch();
+        const int y = (op >> 3) & 7;
+        const int p = y >> 1;
+        switch (op)
+        {
+            case 0x44:                                                    // neg
+            {
+                const uint8_t value = a;
+                a = 0;
+                alu(2, value);
+                tstates += 8;
+                return 0;
+            }
+            case 0xa3:                                                    // outi
+            case 0xb3:                                                    // otir
+            {
+                const uint8_t value = memory[hl()];
+                --b;
+                writePort(bc(), value);
+                setPair(2, hl() + 1);
+                f = (f & flagC) | flagN | (b == 0 ? flagZ : 0);
+                if (op == 0xb3 && b != 0)
+                {
+                    pc -= 2;
+                    tstates += 21;
+                }
+                else
+                {
+                    tstates += 16;
+                }
+                return 0;
+            }
+            case 0xa0:                                                    // ldi
+            case 0xb0:                                                    // ldir
+            {
+                memory[de()] = memory[hl()];
+                setPair(1, de() + 1);
+                setPair(2, hl() + 1);
+                setPair(0, bc() - 1);
+                f = (f & (flagS | flagZ | flagC)) | (bc() != 0 ? flagPV : 0);
+                if (op == 0xb0 && bc() != 0)
+                {
+                    pc -= 2;
+                    tstates += 21;
+                }
+                else
+                {
+                    tstates += 16;
+                }
+                return 0;
+            }
+        }
+        if ((op & 0xc7) == 0x41 && y != 6)
+        {
+            writePort(bc(), reg(y));                                      // out (c),r
+            tstates += 12;
+            return 0;
+        }
+        if ((op & 0xc7) == 0x43)
+        {
+            const uint16_t address = fetch16();
+            if (op & 8)
+                setPair(p, read16(address));                              // ld rr,(nn)
+            else
+                write16(address, pair(p));                                // ld (nn),rr
+            tstates += 20;
+            return 0;
+        }
+        if ((op & 0xc7) == 0x42)
+        {
+            // sbc hl,rr / adc hl,rr
+            const int carry = f & flagC;
+            const int value = pair(p);
+            const int result = (op & 8) ? hl() + value + carry : hl() - value - carry;
+            const uint16_t result16 = (uint16_t) result;
+            f = ((result16 >> 8) & flagS) | (result16 == 0 ? flagZ : 0) | (((hl() ^ value ^ result) >> 8) & flagH)
+                | ((result >> 16) & 1);
+            if (op & 8)
+                f |= ((hl() ^ ~value) & (hl() ^ result) & 0x8000) ? flagPV : 0;
+            else
+                f |= flagN | (((hl() ^ value) & (hl() ^ result) & 0x8000) ? flagPV : 0);
+            setPair(2, result16);
+            tstates += 15;
+            return 0;
+        }
+        return unsupported(opAddress, op, 0xed);
+    }
+
+    int unsupported(uint16_t address, uint8_t op, int prefix = -1) const
+    {
+        std::cerr << "Z80: unsupported opcode " << std::hex;
+        if (prefix >= 0)
+            std::cerr << "#" << prefix << " ";
+        std::cerr << "#" << (int) op << " at #" << address << std::dec << std::endl;
+        return -1;
+    }
+};
+
+/**
+ * Assembler for the sjasm subset that the players use: instructions of the Z80 class above,
+ * labels and numeric temporary labels (1b, 1f), EQU, ORG, DB, DW, DUP/EDUP, MACRO/ENDM without arguments,
+ * ASSERT and DISPLAY. Expressions support + - * / % & | << >> == != ( ) $ high() low().
+ */
+class Z80Assembler
+{
+public:
+
+    std::map<std::string, int> symbols; //< Labels and EQU values. Predefine external symbols before assembling.
+    std::vector<uint8_t> code;
+    int org = 0;
+    bool assertFailed = false;
+
+    int assembleFile(const std::string& fileName, int origin)
+    {
+        std::ifstream fileIn(fileName);
+        if (!fileIn.is_open())
+        {
+            std::cerr << "Can't open player source " << fileName << std::endl;
+            return -1;
+        }
+        std::stringstream source;
+        source << fileIn.rdbuf();
+        return assemble(source.str(), fileName, origin);
+    }
+
+    int assemble(const std::string& source, const std::string& fileName, int origin)
+    {
+        m_fileName = fileName;
+        m_lines.clear();
+        std::string text = source;
+        // Block comments. Keep new lines for the line numbers.
+        for (size_t pos = text.find("/*"); pos != std::string::npos; pos = text.find("/*", pos))
+        {
+            const size_t end = text.find("*/", pos);
+            const size_t last = end == std::string::npos ? text.size() : end + 2;
+            for (size_t i = pos; i < last; ++i)
+            {
+                if (text[i] != '\n')
+                    text[i] = ' ';
+            }
+        }
+        std::istringstream in(text);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            for (const char* comment : { ";", "//" })
+            {
+                const size_t pos = line.find(comment);
+                if (pos != std::string::npos)
+                    line.resize(pos);
+            }
+            while (!line.empty() && isspace((uint8_t) line.back()))
+                line.pop_back();
+            m_lines.push_back(line);
+        }
+
+        const auto predefined = symbols;
+        for (m_pass = 1; m_pass <= 2; ++m_pass)
+        {
+            if (m_pass == 1)
+                symbols = predefined;
+            org = origin;
+            m_address = origin;
+            m_tempLabelIndex.clear();
+            m_macros.clear();
+            code.clear();
+            assertFailed = false;
+            if (assembleLines(0, m_lines.size()) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+private:
+
+    struct Operand
+    {
+        enum Kind { reg8, pair, condition, memory, memoryBc, memoryDe, portC, immediate, afShadow };
+        Kind kind = immediate;
+        int index = 0;      //< Register or condition code.
+        std::string expression;
+    };
+
+    int assembleLines(int from, int to)
+    {
+        for (int i = from; i < to; ++i)
+        {
+            m_lineNumber = i;
+            std::string label;
+            std::string statement = m_lines[i];
+            if (!statement.empty() && !isspace((uint8_t) statement[0]))
+            {
+                size_t end = 0;
+                while (end < statement.size() && !isspace((uint8_t) statement[end]) && statement[end] != ':')
+                    ++end;
+                label = statement.substr(0, end);
+                statement = statement.substr(end < statement.size() && statement[end] == ':' ? end + 1 : end);
+            }
+            statement = trim(statement);
+            std::string keyword = lower(firstWord(statement));
+
+            if (keyword == "equ")
+            {
+                int value;
+                if (evaluate(trim(statement.substr(3)), value) != 0)
+                    return -1;
+                symbols[label] = value;
+                continue;
+            }
+            if (!label.empty() && defineLabel(label) != 0)
+                return -1;
+
+            if (keyword == "macro")
+            {
+                const std::string name = trim(statement.substr(5));
+                const int end = findBlockEnd(i, "macro", "endm");
+                if (end < 0)
+                    return error("MACRO without ENDM");
+                m_macros[name] = { i + 1, end };
+                i = end;
+                continue;
+            }
+            if (keyword == "dup")
+            {
+                int count;
+                if (evaluate(trim(statement.substr(3)), count) != 0)
+                    return -1;
+                const int end = findBlockEnd(i, "dup", "edup");
+                if (end < 0)
+                    return error("DUP without EDUP");
+                for (int j = 0; j < count; ++j)
+                {
+                    if (assembleLines(i + 1, end) != 0)
+                        return -1;
+                }
+                i = end;
+                continue;
+            }
+            auto macro = m_macros.find(statement);
+            if (macro != m_macros.end())
+            {
+                if (assembleLines(macro->second.first, macro->second.second) != 0)
+                    return -1;
+                continue;
+            }
+
+            for (const auto& part : splitStatements(statement))
+            {
+                if (assembleStatement(part) != 0)
+                    return -1;
+            }
+        }
+        return 0;
+    }
+
+    int defineLabel(const std::string& label)
+    {
+        if (isdigit((uint8_t) label[0]))
+        {
+            const int number = std::stoi(label);
+            const int index = m_tempLabelIndex[number]++;
+            auto& addresses = m_tempLabels[number];
+            if (m_pass == 1)
+                addresses.push_back(m_address);
+            else if (index >= addresses.size() || addresses[index] != m_address)
+                return error("phase error at the temporary label " + label);
+            return 0;
+        }
+        if (m_pass == 1 && symbols.count(label))
+            return error("duplicate label " + label);
+        if (m_pass == 2 && symbols[label] != m_address)
+            return error("phase error at the label " + label);
+        symbols[label] = m_address;
+        return 0;
+    }
+
+    int findBlockEnd(int from, const std::string& begin, const std::string& end) const
+    {
+        int depth = 0;
+        for (int i = from; i < m_lines.size(); ++i)
+        {
+            std::string statement = m_lines[i];
+            if (!statement.empty() && !isspace((uint8_t) statement[0]))
+                continue; //< Blocks keywords aren't at the line start.
+            const std::string keyword = lower(firstWord(trim(statement)));
+            if (keyword == begin)
+                ++depth;
+            else if (keyword == end && --depth == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    int assembleStatement(const std::string& statement)
+    {
+        if (statement.empty())
+            return 0;
+        const std::string mnemonic = lower(firstWord(statement));
+        const std::string operandsText = trim(statement.substr(mnemonic.size()));
+
+        if (mnemonic == "display")
+            return 0;
+        if (mnemonic == "assert")
+        {
+            const size_t comma = operandsText.find(',');
+            int value;
+            if (evaluate(trim(operandsText.substr(0, comma)), value) != 0)
+                return -1;
+            if (m_pass == 2 && value == 0)
+                assertFailed = true;
+            return 0;
+        }
+        if (mnemonic == "org")
+        {
+            int value;
+            if (evaluate(operandsText, value) != 0)
+                return -1;
+            if (!code.empty())
+                return error("ORG after code is not supported");
+            org = m_address = value;
+            return 0;
+        }
+
+        const auto operandTexts = splitOperands(operandsText);
+        if (mnemonic == "db" || mnemonic == "defb" || mnemonic == "dw" || mnemonic == "defw")
+        {
+            for (const auto& text : operandTexts)
+            {
+                int value;
+                if (evaluate(text, value) != 0)
+                    return -1;
+                emit(value);
+                if (mnemonic == "dw" || mnemonic == "defw")
+                    emit(value >> 8);
+            }
+            return 0;
+        }
+
+        std::vector<Operand> operands;
+        for (const auto& text : operandTexts)
+            operands.push_back(parseOperand(text, mnemonic));
+        if (encode(mnemonic, operands) != 0)
+            return error("unsupported instruction '" + statement + "'");
+        return 0;
+    }
+
+    Operand parseOperand(const std::string& text, const std::string& mnemonic) const
+    {
+        static const std::vector<std::string> kRegs8 = { "b", "c", "d", "e", "h", "l", "(hl)", "a" };
+        static const std::vector<std::string> kPairs = { "bc", "de", "hl", "sp", "af" };
+        static const std::vector<std::string> kConditions = { "nz", "z", "nc", "c", "po", "pe", "p", "m" };
+
+        Operand result;
+        const std::string name = lower(text);
+        const bool branch = mnemonic == "jp" || mnemonic == "jr" || mnemonic == "call" || mnemonic == "ret";
+        if (branch)
+        {
+            auto itr = std::find(kConditions.begin(), kConditions.end(), name);
+            if (itr != kConditions.end())
+            {
+                result.kind = Operand::condition;
+                result.index = itr - kConditions.begin();
+                return result;
+            }
+        }
+        auto reg = std::find(kRegs8.begin(), kRegs8.end(), name);
+        if (reg != kRegs8.end())
+        {
+            result.kind = Operand::reg8;
+            result.index = reg - kRegs8.begin();
+            return result;
+        }
+        auto pair = std::find(kPairs.begin(), kPairs.end(), name);
+        if (pair != kPairs.end())
+        {
+            result.kind = Operand::pair;
+            result.index = pair - kPairs.begin();
+            return result;
+        }
+        if (name == "af'")
+        {
+            result.kind = Operand::afShadow;
+            return result;
+        }
+        if (name == "(bc)" || name == "(de)" || name == "(c)")
+        {
+            result.kind = name == "(bc)" ? Operand::memoryBc : name == "(de)" ? Operand::memoryDe : Operand::portC;
+            return result;
+        }
+        if (name.size() > 2 && name.front() == '(' && matchingParen(name, 0) == name.size() - 1)
+        {
+            result.kind = Operand::memory;
+            result.expression = text.substr(1, text.size() - 2);
+            return result;
+        }
+        result.expression = text;
+        return result;
+    }
+
+    int encode(const std::string& m, const std::vector<Operand>& ops)
+    {
+        using K = Operand::Kind;
+        const int n = ops.size();
+        auto is = [&](int i, K kind) { return i < n && ops[i].kind == kind; };
+        auto isPair = [&](int i, int index) { return is(i, K::pair) && ops[i].index == index; };
+        auto isA = [&](int i) { return is(i, K::reg8) && ops[i].index == 7; };
+
+        static const std::map<std::string, std::vector<uint8_t>> kSimple = {
+            { "nop", { 0x00 } }, { "rlca", { 0x07 } }, { "rrca", { 0x0f } }, { "rla", { 0x17 } }, { "rra", { 0x1f } },
+            { "cpl", { 0x2f } }, { "scf", { 0x37 } }, { "ccf", { 0x3f } }, { "exx", { 0xd9 } }, { "di", { 0xf3 } },
+            { "ei", { 0xfb } }, { "neg", { 0xed, 0x44 } }, { "outi", { 0xed, 0xa3 } }, { "otir", { 0xed, 0xb3 } },
+            { "ldi", { 0xed, 0xa0 } }, { "ldir", { 0xed, 0xb0 } } };
+        auto simple = kSimple.find(m);
+        if (simple != kSimple.end() && n == 0)
+        {
+            for (auto byte : simple->second)
+                emit(byte);
+            return 0;
+        }
+
+        static const std::vector<std::string> kAlu = { "add", "adc", "sub", "sbc", "and", "xor", "or", "cp" };
+        auto alu = std::find(kAlu.begin(), kAlu.end(), m);
+        if (alu != kAlu.end())
+        {
+            const int op = alu - kAlu.begin();
+            if (n == 2 && isPair(0, 2) && is(1, K::pair) && ops[1].index < 4)
+            {
+                if (op == 0)
+                    emit(0x09 | ops[1].index << 4);                  // add hl,rr
+                else if (op == 1 || op == 3)
+                    emit(0xed), emit((op == 1 ? 0x4a : 0x42) | ops[1].index << 4);
+                else
+                    return -1;
+                return 0;
+            }
+            const Operand* source = n == 2 && isA(0) ? &ops[1] : n == 1 ? &ops[0] : nullptr;
+            if (!source)
+                return -1;
+            if (source->kind == K::reg8)
+                return emit(0x80 | op << 3 | source->index);
+            if (source->kind == K::immediate)
+            {
+                emit(0xc6 | op << 3);
+                return emitExpression(source->expression, 1);
+            }
+            return -1;
+        }
+
+        if (m == "ld" && n == 2)
+        {
+            const auto& dst = ops[0];
+            const auto& src = ops[1];
+            if (dst.kind == K::reg8 && src.kind == K::reg8 && !(dst.index == 6 && src.index == 6))
+                return emit(0x40 | dst.index << 3 | src.index);
+            if (dst.kind == K::reg8 && src.kind == K::immediate)
+            {
+                emit(0x06 | dst.index << 3);
+                return emitExpression(src.expression, 1);
+            }
+            if (dst.kind == K::pair && dst.index < 4 && src.kind == K::immediate)
+            {
+                emit(0x01 | dst.index << 4);
+                return emitExpression(src.expression, 2);
+            }
+            if (isA(0) && src.kind == K::memoryBc)
+                return emit(0x0a);
+            if (isA(0) && src.kind == K::memoryDe)
+                return emit(0x1a);
+            if (dst.kind == K::memoryBc && isA(1))
+                return emit(0x02);
+            if (dst.kind == K::memoryDe && isA(1))
+                return emit(0x12);
+            if (isA(0) && src.kind == K::memory)
+            {
+                emit(0x3a);
+                return emitExpression(src.expression, 2);
+            }
+            if (dst.kind == K::memory && isA(1))
+            {
+                emit(0x32);
+                return emitExpression(dst.expression, 2);
+            }
+            if (isPair(0, 2) && src.kind == K::memory)
+            {
+                emit(0x2a);
+                return emitExpression(src.expression, 2);
+            }
+            if (dst.kind == K::memory && isPair(1, 2))
+            {
+                emit(0x22);
+                return emitExpression(dst.expression, 2);
+            }
+            if (dst.kind == K::pair && dst.index < 4 && src.kind == K::memory)
+            {
+                emit(0xed), emit(0x4b | dst.index << 4);
+                return emitExpression(src.expression, 2);
+            }
+            if (dst.kind == K::memory && src.kind == K::pair && src.index < 4)
+            {
+                emit(0xed), emit(0x43 | src.index << 4);
+                return emitExpression(dst.expression, 2);
+            }
+            if (isPair(0, 3) && isPair(1, 2))
+                return emit(0xf9);
+            return -1;
+        }
+
+        if ((m == "inc" || m == "dec") && n == 1)
+        {
+            if (is(0, K::reg8))
+                return emit((m == "inc" ? 0x04 : 0x05) | ops[0].index << 3);
+            if (is(0, K::pair) && ops[0].index < 4)
+                return emit((m == "inc" ? 0x03 : 0x0b) | ops[0].index << 4);
+            return -1;
+        }
+
+        if (m == "jr" || m == "djnz")
+        {
+            const Operand* target = &ops.back();
+            if (m == "djnz" && n == 1)
+                emit(0x10);
+            else if (n == 1)
+                emit(0x18);
+            else if (n == 2 && is(0, K::condition) && ops[0].index < 4)
+                emit(0x20 | ops[0].index << 3);
+            else
+                return -1;
+            int value;
+            if (evaluate(target->expression, value) != 0)
+                return -1;
+            const int offset = value - (m_address + 1);
+            if (m_pass == 2 && (offset < -128 || offset > 127))
+                return error("relative jump is out of range");
+            return emit(offset);
+        }
+
+        if (m == "jp" || m == "call")
+        {
+            if (m == "jp" && n == 1 && isPair(0, 2))
+                return emit(0xe9);
+            if (m == "jp" && n == 1 && is(0, K::memory) && lower(ops[0].expression) == "hl")
+                return emit(0xe9);
+            if (n == 1 && is(0, K::immediate))
+                emit(m == "jp" ? 0xc3 : 0xcd);
+            else if (n == 2 && is(0, K::condition))
+                emit((m == "jp" ? 0xc2 : 0xc4) | ops[0].index << 3);
+            else
+                return -1;
+            return emitExpression(ops.back().expression, 2);
+        }
+
+        if (m == "ret")
+        {
+            if (n == 0)
+                return emit(0xc9);
+            if (n == 1 && is(0, K::condition))
+                return emit(0xc0 | ops[0].index << 3);
+            return -1;
+        }
+
+        if ((m == "push" || m == "pop") && n == 1 && is(0, K::pair) && ops[0].index != 3)
+        {
+            const int index = ops[0].index == 4 ? 3 : ops[0].index;
+            return emit((m == "push" ? 0xc5 : 0xc1) | index << 4);
+        }
+
+        if (m == "ex" && n == 2)
+        {
+            if (isPair(0, 1) && isPair(1, 2))
+                return emit(0xeb);
+            if (isPair(0, 4) && is(1, K::afShadow))
+                return emit(0x08);
+            if (is(0, K::memory) && lower(ops[0].expression) == "sp" && isPair(1, 2))
+                return emit(0xe3);
+            return -1;
+        }
+
+        if (m == "out" && n == 2)
+        {
+            if (is(0, K::portC) && is(1, K::reg8) && ops[1].index != 6)
+                return emit(0xed), emit(0x41 | ops[1].index << 3);
+            if (is(0, K::memory) && isA(1))
+            {
+                emit(0xd3);
+                return emitExpression(ops[0].expression, 1);
+            }
+            return -1;
+        }
+
+        static const std::vector<std::string> kShifts = { "rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl" };
+        auto shift = std::find(kShifts.begin(), kShifts.end(), m);
+        if (shift != kShifts.end() && n == 1 && is(0, K::reg8))
+            return emit(0xcb), emit((shift - kShifts.begin()) << 3 | ops[0].index);
+
+        if ((m == "bit" || m == "res" || m == "set") && n == 2 && is(1, K::reg8))
+        {
+            int bit;
+            if (evaluate(ops[0].expression, bit) != 0)
+                return -1;
+            const int base = m == "bit" ? 0x40 : m == "res" ? 0x80 : 0xc0;
+            return emit(0xcb), emit(base | (bit & 7) << 3 | ops[1].index);
+        }
+
+        if (m == "rst" && n == 1)
+        {
+            int value;
+            if (evaluate(ops[0].expression, value) != 0)
+                return -1;
+            return emit(0xc7 | (value & 0x38));
+        }
+        return -1;
+    }
+
+    int emit(int value)
+    {
+        code.push_back((uint8_t) value);
+        ++m_address;
+        return 0;
+    }
+
+    int emitExpression(const std::string& expression, int size)
+    {
+        int value;
+        if (evaluate(expression, value) != 0)
+            return -1;
+        emit(value);
+        if (size == 2)
+            emit(value >> 8);
+        return 0;
+    }
+
+    // Expressions
+
+    int evaluate(const std::string& text, int& value)
+    {
+        m_expression = text;
+        m_expressionPos = 0;
+        m_expressionError.clear();
+        value = parseCompare();
+        skipSpaces();
+        if (m_expressionError.empty() && m_expressionPos != m_expression.size())
+            m_expressionError = "unexpected '" + m_expression.substr(m_expressionPos) + "'";
+        if (!m_expressionError.empty())
+            return error(m_expressionError + " in expression '" + text + "'");
+        return 0;
+    }
+
+    void skipSpaces()
+    {
+        while (m_expressionPos < m_expression.size() && isspace((uint8_t) m_expression[m_expressionPos]))
+            ++m_expressionPos;
+    }
+
+    bool accept(const char* token)
+    {
+        skipSpaces();
+        const size_t size = strlen(token);
+        if (m_expression.compare(m_expressionPos, size, token) != 0)
+            return false;
+        m_expressionPos += size;
+        return true;
+    }
+
+    int parseCompare()
+    {
+        int value = parseOr();
+        if (accept("=="))
+            return value == parseOr();
+        if (accept("!="))
+            return value != parseOr();
+        return value;
+    }
+
+    int parseOr()
+    {
+        int value = parseAnd();
+        while (accept("|"))
+            value |= parseAnd();
+        return value;
+    }
+
+    int parseAnd()
+    {
+        int value = parseShift();
+        while (accept("&"))
+            value &= parseShift();
+        return value;
+    }
+
+    int parseShift()
+    {
+        int value = parseSum();
+        for (;;)
+        {
+            if (accept("<<"))
+                value <<= parseSum();
+            else if (accept(">>"))
+                value >>= parseSum();
+            else
+                return value;
+        }
+    }
+
+    int parseSum()
+    {
+        int value = parseProduct();
+        for (;;)
+        {
+            if (accept("+"))
+                value += parseProduct();
+            else if (accept("-"))
+                value -= parseProduct();
+            else
+                return value;
+        }
+    }
+
+    int parseProduct()
+    {
+        int value = parseUnary();
+        for (;;)
+        {
+            if (accept("*"))
+            {
+                value *= parseUnary();
+            }
+            else if (accept("/") || accept("%"))
+            {
+                const bool division = m_expression[m_expressionPos - 1] == '/';
+                const int divider = parseUnary();
+                if (divider == 0)
+                {
+                    m_expressionError = "division by zero";
+                    return 0;
+                }
+                value = division ? value / divider : value % divider;
+            }
+            else
+            {
+                return value;
+            }
+        }
+    }
+
+    int parseUnary()
+    {
+        if (accept("-"))
+            return -parseUnary();
+        if (accept("+"))
+            return parseUnary();
+        if (accept("~"))
+            return ~parseUnary();
+        return parsePrimary();
+    }
+
+    int parsePrimary()
+    {
+        skipSpaces();
+        if (accept("("))
+        {
+            const int value = parseCompare();
+            if (!accept(")"))
+                m_expressionError = "')' expected";
+            return value;
+        }
+        const size_t from = m_expressionPos;
+        if (from >= m_expression.size())
+        {
+            m_expressionError = "value expected";
+            return 0;
+        }
+        const char first = m_expression[from];
+        if (first == '\'' && from + 2 < m_expression.size() && m_expression[from + 2] == '\'')
+        {
+            m_expressionPos += 3;
+            return (uint8_t) m_expression[from + 1];
+        }
+
+        size_t end = from + 1;
+        while (end < m_expression.size() && (isalnum((uint8_t) m_expression[end]) || m_expression[end] == '_' || m_expression[end] == '.'))
+            ++end;
+        const std::string token = m_expression.substr(from, end - from);
+        m_expressionPos = end;
+
+        if (token == "$")
+            return m_address;
+        if (first == '#' || (first == '$' && token.size() > 1))
+            return parseNumber(token.substr(1), 16);
+        if (first == '%')
+            return parseNumber(token.substr(1), 2);
+        if (isdigit((uint8_t) first))
+        {
+            const char suffix = tolower(token.back());
+            const bool digitsOnly = std::all_of(token.begin(), token.end() - 1, [](char ch) { return isdigit((uint8_t) ch); });
+            if (digitsOnly && token.size() > 1 && (suffix == 'b' || suffix == 'f'))
+                return tempLabel(std::stoi(token), suffix == 'f');
+            if (token.size() > 2 && token[0] == '0' && tolower(token[1]) == 'x')
+                return parseNumber(token.substr(2), 16);
+            if (suffix == 'h')
+                return parseNumber(token.substr(0, token.size() - 1), 16);
+            return parseNumber(token, 10);
+        }
+        if (!isalpha((uint8_t) first) && first != '_' && first != '.')
+        {
+            m_expressionError = "unexpected '" + m_expression.substr(from) + "'";
+            return 0;
+        }
+
+        const std::string function = lower(token);
+        if ((function == "high" || function == "low") && accept("("))
+        {
+            const int value = parseCompare();
+            if (!accept(")"))
+                m_expressionError = "')' expected";
+            return function == "high" ? (value >> 8) & 0xff : value & 0xff;
+        }
+        auto itr = symbols.find(token);
+        if (itr != symbols.end())
+            return itr->second;
+        if (m_pass == 2)
+            m_expressionError = "undefined symbol " + token;
+        return 0;
+    }
+
+    int parseNumber(const std::string& digits, int base)
+    {
+        if (digits.empty())
+        {
+            m_expressionError = "invalid number";
+            return 0;
+        }
+        size_t end = 0;
+        const int value = std::stoi(digits, &end, base);
+        if (end != digits.size())
+            m_expressionError = "invalid number " + digits;
+        return value;
+    }
+
+    int tempLabel(int number, bool forward)
+    {
+        const auto& addresses = m_tempLabels[number];
+        const int index = m_tempLabelIndex[number] + (forward ? 0 : -1);
+        if (index >= 0 && index < addresses.size())
+            return addresses[index];
+        if (m_pass == 2)
+            m_expressionError = "temporary label " + std::to_string(number) + " is not found";
+        return 0;
+    }
+
+    // Text helpers
+
+    static std::string trim(const std::string& s)
+    {
+        size_t from = 0;
+        size_t to = s.size();
+        while (from < to && isspace((uint8_t) s[from]))
+            ++from;
+        while (to > from && isspace((uint8_t) s[to - 1]))
+            --to;
+        return s.substr(from, to - from);
+    }
+
+    static std::string lower(std::string s)
+    {
+        for (auto& ch : s)
+            ch = tolower((uint8_t) ch);
+        return s;
+    }
+
+    static std::string firstWord(const std::string& s)
+    {
+        size_t end = 0;
+        while (end < s.size() && !isspace((uint8_t) s[end]))
+            ++end;
+        return s.substr(0, end);
+    }
+
+    static size_t matchingParen(const std::string& s, size_t pos)
+    {
+        int depth = 0;
+        for (size_t i = pos; i < s.size(); ++i)
+        {
+            if (s[i] == '(')
+                ++depth;
+            else if (s[i] == ')' && --depth == 0)
+                return i;
+        }
+        return std::string::npos;
+    }
+
+    /** 'rrca:rrca' is two statements. */
+    static std::vector<std::string> splitStatements(const std::string& s)
+    {
+        std::vector<std::string> result;
+        std::string current;
+        bool quoted = false;
+        for (char ch : s)
+        {
+            if (ch == '\'' || ch == '"')
+                quoted = !quoted;
+            if (ch == ':' && !quoted)
+            {
+                result.push_back(trim(current));
+                current.clear();
+                continue;
+            }
+            current += ch;
+        }
+        result.push_back(trim(current));
+        return result;
+    }
+
+    static std::vector<std::string> splitOperands(const std::string& s)
+    {
+        std::vector<std::string> result;
+        if (s.empty())
+            return result;
+        std::string current;
+        int depth = 0;
+        for (char ch : s)
+        {
+            if (ch == '(')
+                ++depth;
+            else if (ch == ')')
+                --depth;
+            if (ch == ',' && depth == 0)
+            {
+                result.push_back(trim(current));
+                current.clear();
+                continue;
+            }
+            current += ch;
+        }
+        result.push_back(trim(current));
+        return result;
+    }
+
+    int error(const std::string& message) const
+    {
+        std::cerr << m_fileName << ":" << m_lineNumber + 1 << ": " << message << std::endl;
+        return -1;
+    }
+
+    std::string m_fileName;
+    std::vector<std::string> m_lines;
+    int m_pass = 0;
+    int m_address = 0;
+    int m_lineNumber = 0;
+    std::map<std::string, std::pair<int, int>> m_macros; //< name -> [first line, ENDM line)
+    std::map<int, std::vector<int>> m_tempLabels;        //< number -> addresses in the source order
+    std::map<int, int> m_tempLabelIndex;                 //< number -> definitions passed
+    std::string m_expression;
+    size_t m_expressionPos = 0;
+    std::string m_expressionError;
+};
+
+/**
+ * Runs a player from include/ on the Z80 core and measures every frame in t-states, from the first
+ * instruction of 'play' to its 'ret', as TimingsHelper counts them. The writes to the AY ports are
+ * collected as well, so the result can be compared with PsgUnpacker.
+ */
+class Z80Player
+{
+public:
+
+    static const int kMusicAddress = 0x0100;
+    static const int kStackTop = 0xff00;
+    static const int kMaxFrameTstates = 100000;
+
+    std::vector<int> timings;   //< t-states of every frame.
+    std::vector<RegMap> frames; //< AY regs written at every frame.
+    int loopTimings = 0;        //< The call that meets the end of track and restarts the music.
+
+    /** Player source for the compression level. */
+    static std::string playerFileName(const std::string& playerDir, int level)
+    {
+        const std::string name = level >= l4 ? "l4_psg_player.asm" : "fast_psg_player.asm";
+        if (playerDir.empty())
+            return name;
+        const char last = playerDir.back();
+        return playerDir + (last == '/' || last == '\\' ? "" : "/") + name;
+    }
+
+    /**
+     * Assemble the player above the music and play the music till the end of track. Return 0 on success.
+     */
+    int run(const std::string& playerFileName, const std::vector<uint8_t>& music)
+    {
+        timings.clear();
+        frames.clear();
+        loopTimings = 0;
+
+        Z80Assembler assembler;
+        assembler.symbols["music"] = kMusicAddress;
+        if (assembler.assembleFile(playerFileName, kMusicAddress) != 0)
+            return -1;
+        const int playerSize = assembler.code.size();
+        // Move the player down until its asserts pass, the same way as the asserts ask to do.
+        int origin = (kStackTop - playerSize) & ~15;
+        do
+        {
+            Z80Assembler placed;
+            placed.symbols["music"] = kMusicAddress;
+            if (placed.assembleFile(playerFileName, origin) != 0)
+                return -1;
+            if (!placed.assertFailed)
+            {
+                assembler = std::move(placed);
+                break;
+            }
+            origin -= 16;
+        } while (origin > kMusicAddress);
+        if (assembler.assertFailed)
+        {
+            std::cerr << "Asserts of the player " << playerFileName << " fail at any address" << std::endl;
+            return -1;
+        }
+        if (kMusicAddress + music.size() > assembler.org)
+        {
+            std::cerr << "The packed data of " << music.size() << " bytes doesn't fit into Z80 memory with the player" << std::endl;
+            return -1;
+        }
+        for (const char* name : { "init", "play", "endtrack" })
+        {
+            if (!assembler.symbols.count(name))
+            {
+                std::cerr << "The player " << playerFileName << " doesn't define '" << name << "'" << std::endl;
+                return -1;
+            }
+        }
+
+        Z80 cpu;
+        std::copy(music.begin(), music.end(), cpu.memory.begin() + kMusicAddress);
+        std::copy(assembler.code.begin(), assembler.code.end(), cpu.memory.begin() + assembler.org);
+        cpu.sp = kStackTop + 0x100 - 2;
+        cpu.pc = 0; //< The return address of the calls. It is never executed.
+
+        RegMap regs;
+        int selectedReg = 0;
+        cpu.out = [&](uint16_t port, uint8_t value)
+        {
+            // ZX Spectrum 128 decoding: #fffd selects an AY register, #bffd writes it.
+            if ((port & 0xc002) == 0xc000)
+                selectedReg = value;
+            else if ((port & 0xc002) == 0x8000 && selectedReg < kRegCount)
+                regs.set(selectedReg, value);
+        };
+
+        if (cpu.call(assembler.symbols["init"], kMaxFrameTstates) != 0)
+            return -1;
+        cpu.breakpoint = assembler.symbols["endtrack"];
+        for (;;)
+        {
+            regs.clear();
+            const uint64_t from = cpu.tstates;
+            if (cpu.call(assembler.symbols["play"], kMaxFrameTstates) != 0)
+                return -1;
+            const int frameTimings = cpu.tstates - from;
+            if (cpu.breakpointHit)
+            {
+                loopTimings = frameTimings;
+                return 0;
+            }
+            timings.push_back(frameTimings);
+            frames.push_back(regs);
+            if (timings.size() >= PsgUnpacker::kMaxFrames)
+            {
+                std::cerr << "The player doesn't reach the end of track" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+};